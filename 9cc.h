@@ -1,6 +1,7 @@
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
 #define _POSIX_C_SOURCE 200809L
 #include <ctype.h>
+#include <errno.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -8,6 +9,7 @@
 #include <string.h>
 #include <ctype.h>
 #include <locale.h>
+#include <limits.h>
 
 typedef enum TokenKind TokenKind;
 enum TokenKind {
@@ -24,6 +26,8 @@ struct Token {
     int val;        // 数値トークンのときはその値
     char *str;      // トークン文字列
     int len;        // トークンの長さ
+    int line;       // 入力中の行番号(1から始まる)
+    int col;        // 入力中の桁番号(1から始まる)
 };
 
 // 抽象構文木のノード種別
@@ -49,6 +53,13 @@ enum NodeKind {
     ND_FUNCALL,    //関数呼び出し
 };
 
+// x86-64の汎用レジスタ。値は命令中でのレジスタ番号
+typedef enum Reg Reg;
+enum Reg {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15,
+};
+
 // ローカル変数を表す型
 typedef struct LVar LVar;
 struct LVar {
@@ -56,6 +67,9 @@ struct LVar {
     char *name;  // 変数の名前
     int len;     // 変数の名前の長さ
     int offset;  // RBPからの距離
+    bool in_reg;    // レジスタに割り当てられているか(pgo.c)
+    Reg reg;        // 割り当てられたレジスタ
+    double weight;  // 実行頻度で重み付けした出現回数。レジスタ割り当ての優先度に使う
 };
 
 typedef struct Node Node;
@@ -64,6 +78,8 @@ struct Node {
 
     Node *next;    // 次の文
 
+    Token *tok;    // 文や関数呼び出しの先頭のトークン。位置の報告に使う
+
     Node *lhs;     // 左辺
     Node *rhs;     // 右辺
 
@@ -90,17 +106,79 @@ struct Node {
     // kindがND_FUNCALLのときに使う
     char *funcname;
     Node *args;
+    Node *inlined;  // インライン展開した呼び出し先の本体の複製(pgo.c)
 };
 
 typedef struct Function Function;
 struct Function {
     char *name;
+    Token *tok;     // 関数名のトークン
+    Token *end;     // 関数の本体の直後のトークン
     Node *nodes;
     LVar *locals;
     int stack_size;
+    bool pure;      // 副作用を持たない関数であるか(fold.c)
     Function *next;
 };
 
+// 条件コード。値はJcc/SETccのオペコードの下位4ビット
+typedef enum CondCode CondCode;
+enum CondCode {
+    CC_E  = 0x4,  // ==
+    CC_NE = 0x5,  // !=
+    CC_L  = 0xc,  // <
+    CC_LE = 0xe,  // <=
+};
+
+// 2オペランドの演算命令
+typedef enum ArithOp ArithOp;
+enum ArithOp {
+    OP_ADD,
+    OP_SUB,
+    OP_AND,
+    OP_CMP,
+    OP_IMUL,
+};
+
+// 機械語中の関数の位置
+typedef struct Symbol Symbol;
+struct Symbol {
+    Symbol *next;
+    char *name;
+    int offset;
+};
+
+// 関数呼び出しの再配置情報
+typedef struct Reloc Reloc;
+struct Reloc {
+    Reloc *next;
+    char *name;  // 呼び出し先の関数名
+    int offset;  // callのrel32の位置
+};
+
+// デバッグ情報に記録する入力のファイル名。入力はコマンドライン引数で与えられる
+#define DEBUG_FILE_NAME "<command-line>"
+
+// 機械語の位置と入力中の位置の対応(-g)
+typedef struct LineInfo LineInfo;
+struct LineInfo {
+    LineInfo *next;
+    int offset;
+    int line;
+    int col;
+};
+
+// 機械語の出力結果
+typedef struct Code Code;
+struct Code {
+    unsigned char *data;
+    int len;
+    int cap;
+    Symbol *symbols;
+    Reloc *relocs;
+    LineInfo *lines;  // 機械語の位置の順に並ぶ
+};
+
 // 現在着目しているトークン
 extern Token *token;
 // 入力プログラム
@@ -110,9 +188,110 @@ extern char *user_input;
 extern void error(char *fmt, ...);
 extern bool startswith(char *prefix, char *str);
 
+// main.c
+extern int opt_unroll_factor;
+extern bool opt_fold_pure_calls;
+extern bool opt_run;
+extern bool opt_object;
+extern bool opt_interp;
+extern bool opt_time_report;
+extern bool opt_time_report_json;
+extern bool opt_instrument;
+extern bool opt_instrument_branches;
+extern bool opt_instrument_cycles;
+extern char *opt_profile_use;
+extern bool opt_debug_info;
+extern int compiler_main(int argc, char **argv);
+
 // parse.c
 extern Token *tokenize(char *p);
 extern Function* program(void);
+extern Node *new_node(NodeKind kind);
+extern Node *new_node_binary(NodeKind kind, Node *lhs, Node *rhs);
+extern Node *new_node_num(int val);
+extern bool walk_nodes(Node *node, bool post, bool (*visit)(Node *node, void *arg), void *arg);
+extern Node *copy_node(Node *node, LVar *(*map_var)(LVar *var));
+extern Node *copy_list(Node *node, LVar *(*map_var)(LVar *var));
+extern int count_nodes(Node *node);
+extern Function *find_function(Function *prog, char *name);
+
+// fold.c
+extern void fold_pure_calls(Function *prog);
+
+// unroll.c
+extern void unroll_loops(Function *prog);
+
+// pgo.c
+// レジスタに割り当てるローカル変数の最大数
+#define MAX_REG_VARS 5
+extern bool profile_loaded;
+extern void load_profile(char *path);
+extern bool pgo_then_is_cold(Node *node);
+extern int pgo_assign_registers(Function *fn, Reg *regs);
+extern void pgo_inline(Function *prog);
 
 // gen.c
+extern void assign_lvar_offsets(Function *prog);
 extern void gencode(Function *prog);
+
+// emit.c
+extern bool emit_machine_code;
+extern FILE *output;
+extern Code *code;
+extern void emit_begin(void);
+extern void emit_end(void);
+extern void emit_comment(char *fmt, ...);
+extern void emit_raw(char *fmt, ...);
+extern void emit_function(char *name);
+extern void emit_label(char *fmt, ...);
+extern void emit_push(Reg r);
+extern void emit_push_imm(int val);
+extern void emit_pop(Reg r);
+extern void emit_mov(Reg dst, Reg src);
+extern void emit_mov_imm(Reg dst, int val);
+extern void emit_load(Reg dst, Reg base);
+extern void emit_store(Reg base, Reg src);
+extern void emit_load_local(Reg dst, int offset);
+extern void emit_store_local(int offset, Reg src);
+extern void emit_lea_local(Reg dst, int offset);
+extern void emit_op(ArithOp op, Reg dst, Reg src);
+extern void emit_op_imm(ArithOp op, Reg dst, int imm);
+extern void emit_cqo(void);
+extern void emit_idiv(Reg r);
+extern void emit_setcc(CondCode cc);
+extern void emit_jmp(char *fmt, ...);
+extern void emit_jcc(CondCode cc, char *fmt, ...);
+extern void emit_call(char *name);
+extern void emit_ret(void);
+extern void emit_loc(Token *tok);
+extern Symbol *find_symbol(Code *code, char *name);
+extern int symbol_size(Code *code, Symbol *sym);
+
+// elf.c
+extern void write_elf(Code *code, FILE *out);
+
+// interp.c
+extern int interpret(Function *prog);
+
+// instrument.c
+extern void instrument_prologue(int idx, int offset);
+extern void instrument_epilogue(int idx, int offset);
+extern int instrument_branch(char *kind, Node *node);
+extern void instrument_count(int id, int which);
+extern void instrument_runtime(Function *prog);
+
+// report.c
+extern void phase_begin(char *name);
+extern void phase_end(Function *prog);
+extern void print_time_report(Token *tok, Function *prog);
+
+// jit.c
+extern void jit_load_library(char *path);
+extern int jit_run(Code *code);
+
+// server.c
+extern bool cache_lookup(Function *fn);
+extern void cache_begin(void);
+extern void cache_end(void);
+extern void run_server(char *path);
+extern int run_client(char *path, int argc, char **argv);
@@ -0,0 +1,182 @@
+#!/bin/sh
+
+# 合成したプログラムで9ccのコンパイル速度と生成コードの性能を測る。
+# 次の環境変数で規模を変えられる(入力はコマンドライン引数で渡すため、128KBに収まる範囲で)。
+#   FUNCS  関数の数            LOCALS 関数ごとのローカル変数の数
+#   DEPTH  式の入れ子の深さ    ITERS  関数ごとのループの反復回数
+#   RUNS   計測の繰り返し回数  SEED   乱数の種
+FUNCS=${FUNCS:-100}
+LOCALS=${LOCALS:-16}
+DEPTH=${DEPTH:-16}
+ITERS=${ITERS:-100000}
+RUNS=${RUNS:-5}
+SEED=${SEED:-1}
+
+# 最適化のオプションの組み合わせ。-fprofile-useのプロファイルは計測の前に作る。
+# -finstrumentの組み合わせは、計測用のコードによる実行時間の増加をnoneと比べる
+CONFIGS="none -funroll-loops -ffold-pure-calls -fprofile-use all -finstrument -finstrument=branches -finstrument=cycles"
+
+flags_of() {
+    case "$1" in
+        none) echo "" ;;
+        -fprofile-use) echo "-fprofile-use=tmp-bench.prof" ;;
+        all) echo "-funroll-loops -ffold-pure-calls -fprofile-use=tmp-bench.prof" ;;
+        *) echo "$1" ;;
+    esac
+}
+
+# 9cc用の入力をtmp-bench.9ccに、同じプログラムをCで書いたものをtmp-bench.gccに出力する
+generate() {
+    awk -v funcs="$FUNCS" -v nlocals="$LOCALS" -v depth="$DEPTH" -v iters="$ITERS" -v seed="$SEED" '
+    function leaf(  r) {
+        r = int(rand() * 4)
+        if (r == 0) return "a" int(rand() * nlocals)
+        if (r == 1) return "k"
+        if (r == 2) return int(rand() * 10) + 1
+        return "a" int(rand() * nlocals) " * " (int(rand() * 3) + 1)
+    }
+    function expr(d) {
+        if (d == 0) return leaf()
+        return "(" leaf() (rand() < 0.5 ? " + " : " - ") expr(d - 1) ")"
+    }
+    function both(s) {
+        print s > "tmp-bench.9cc"
+        print s > "tmp-bench.gcc"
+    }
+    BEGIN {
+        srand(seed)
+        decl = "s, k"
+        for (j = 0; j < nlocals; j++) {
+            decl = decl ", a" j
+        }
+
+        for (i = 0; i < 4; i++) {
+            print "l" i "() { return " i + 1 "; }" > "tmp-bench.9cc"
+            print "long l" i "(void) { return " i + 1 "; }" > "tmp-bench.gcc"
+        }
+        for (i = 0; i < funcs; i++) {
+            print "f" i "() {" > "tmp-bench.9cc"
+            print "long f" i "(void) { long " decl ";" > "tmp-bench.gcc"
+            for (j = 0; j < nlocals; j++) {
+                both("a" j " = " int(rand() * 100) + 1 ";")
+            }
+            both("s = 0;")
+            both("for (k = 0; k < " iters "; k = k + 1) {")
+            both("s = s + " expr(depth) " + l" i % 4 "();")
+            both("while (s > 1000000) s = s - 1000000;")
+            both("while (s < 0) s = s + 1000000;")
+            both("}")
+            both("return s;")
+            both("}")
+        }
+
+        print "main() {" > "tmp-bench.9cc"
+        print "int main(void) { long t;" > "tmp-bench.gcc"
+        both("t = 0;")
+        for (i = 0; i < funcs; i++) {
+            both("t = t + f" i "(); while (t > 1000000) t = t - 1000000;")
+        }
+        both("return t - t / 256 * 256;")
+        both("}")
+    }'
+}
+
+# ミリ秒単位の現在時刻
+now_ms() {
+    echo $(($(date +%s%N) / 1000000))
+}
+
+# -ftime-report=jsonの出力から、フェーズ$2の値$3を取り出す
+phase_value() {
+    sed -n "s/.*{\"name\": \"$2\"[^}]*\"$3\": \([0-9.]*\).*/\1/p" "$1"
+}
+
+# 実行して経過時間(最良値、ミリ秒)、命令数、終了ステータスを表示する。最良値はbestに残す
+measure_run() {
+    label="$1"
+    best=""
+    for i in $(seq "$RUNS"); do
+        start=$(now_ms)
+        ./tmp-bench
+        status="$?"
+        elapsed=$(($(now_ms) - start))
+        if [ -z "$best" ] || [ "$elapsed" -lt "$best" ]; then
+            best="$elapsed"
+        fi
+    done
+
+    insns="-"
+    if command -v perf > /dev/null; then
+        insns=$(perf stat -x, -e instructions:u ./tmp-bench 2>&1 > /dev/null | awk -F, '/instructions/ { print $1 }')
+    fi
+
+    printf '%-24s %10s %16s %6s\n' "$label" "$best" "$insns" "$status"
+    if [ "$status" != "$expected" ]; then
+        echo "$label: exit status $expected expected, but got $status"
+        exit 1
+    fi
+}
+
+generate
+src=$(cat tmp-bench.9cc)
+size=$(wc -c < tmp-bench.9cc)
+if [ "$size" -ge 131072 ]; then
+    echo "generated program is too large ($size bytes); reduce FUNCS, LOCALS or DEPTH"
+    exit 1
+fi
+
+# -fprofile-useのためのプロファイルを作る
+rm -f tmp-bench.prof
+./9cc -finstrument=branches "$src" > tmp-bench.s || exit 1
+gcc -o tmp-bench tmp-bench.s || exit 1
+NINECC_PROFILE=tmp-bench.prof ./tmp-bench
+
+echo "== compile throughput (FUNCS=$FUNCS LOCALS=$LOCALS DEPTH=$DEPTH, $size bytes, $RUNS runs) =="
+printf '%-24s %12s %12s %14s\n' "flags" "tokens/s" "nodes/s" "codegen MB/s"
+for config in $CONFIGS; do
+    flags=$(flags_of "$config")
+    lex=0 parse=0 codegen=0
+    for i in $(seq "$RUNS"); do
+        ./9cc -ftime-report=json $flags "$src" > tmp-bench.s 2> tmp-bench.json || exit 1
+        lex=$(awk "BEGIN { print $lex + $(phase_value tmp-bench.json lex wall_ms) }")
+        parse=$(awk "BEGIN { print $parse + $(phase_value tmp-bench.json parse wall_ms) }")
+        codegen=$(awk "BEGIN { print $codegen + $(phase_value tmp-bench.json codegen wall_ms) }")
+    done
+    tokens=$(sed -n 's/^{"tokens": \([0-9]*\).*/\1/p' tmp-bench.json)
+    nodes=$(phase_value tmp-bench.json parse nodes)
+    bytes=$(wc -c < tmp-bench.s)
+    awk -v label="$config" -v runs="$RUNS" -v tokens="$tokens" -v nodes="$nodes" -v bytes="$bytes" \
+        -v lex="$lex" -v parse="$parse" -v codegen="$codegen" 'BEGIN {
+        printf "%-24s %12.0f %12.0f %14.1f\n", label,
+            tokens * runs / (lex / 1000), nodes * runs / (parse / 1000), bytes * runs / 1e6 / (codegen / 1000)
+    }'
+done
+
+echo
+echo "== generated code (ITERS=$ITERS, best of $RUNS runs) =="
+printf '%-24s %10s %16s %6s\n' "compiler" "time(ms)" "instructions" "exit"
+gcc -O0 -xc -o tmp-bench tmp-bench.gcc || exit 1
+./tmp-bench
+expected="$?"
+measure_run "gcc -O0"
+# 計測用のコードを入れたプログラムが書き出すプロファイルは捨てる
+export NINECC_PROFILE=tmp-bench-run.prof
+overheads=""
+for config in $CONFIGS; do
+    ./9cc $(flags_of "$config") "$src" > tmp-bench.s || exit 1
+    gcc -o tmp-bench tmp-bench.s || exit 1
+    measure_run "9cc $config"
+    case "$config" in
+        none) none_ms="$best" ;;
+        -finstrument*) overheads="$overheads $config:$best" ;;
+    esac
+done
+
+echo
+echo "== instrumentation overhead (against 9cc none) =="
+for o in $overheads; do
+    awk -v label="${o%:*}" -v ms="${o##*:}" -v base="$none_ms" 'BEGIN {
+        printf "%-24s %+9.1f%%\n", label, (base > 0 ? (ms - base) * 100 / base : 0)
+    }'
+done
+rm -f tmp-bench-run.prof
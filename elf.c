@@ -0,0 +1,431 @@
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
+#include "9cc.h"
+#include <elf.h>
+#include <stdint.h>
+
+// セクションの番号
+enum {
+    SEC_NULL,
+    SEC_TEXT,
+    SEC_SYMTAB,
+    SEC_STRTAB,
+    SEC_RELA_TEXT,
+    SEC_NOTE_STACK,
+    SEC_SHSTRTAB,
+    // 以下はデバッグ情報を出力するときだけ使う
+    SEC_DEBUG_ABBREV,
+    SEC_DEBUG_INFO,
+    SEC_RELA_DEBUG_INFO,
+    SEC_DEBUG_LINE,
+    SEC_RELA_DEBUG_LINE,
+    SEC_NUM,
+};
+
+// デバッグ情報の再配置で使う、セクションを表すローカルなシンボルの番号
+enum {
+    SYM_TEXT = 1,
+    SYM_DEBUG_ABBREV,
+    SYM_DEBUG_LINE,
+    SYM_NUM_LOCAL,
+};
+
+// DWARFの定数
+enum {
+    DW_TAG_compile_unit = 0x11,
+    DW_CHILDREN_no = 0,
+    DW_AT_name = 0x03,
+    DW_AT_stmt_list = 0x10,
+    DW_AT_low_pc = 0x11,
+    DW_AT_high_pc = 0x12,
+    DW_AT_language = 0x13,
+    DW_AT_producer = 0x25,
+    DW_FORM_addr = 0x01,
+    DW_FORM_data2 = 0x05,
+    DW_FORM_data8 = 0x07,
+    DW_FORM_string = 0x08,
+    DW_FORM_sec_offset = 0x17,
+    DW_LANG_C99 = 0x0c,
+    DW_LNS_copy = 1,
+    DW_LNS_advance_pc = 2,
+    DW_LNS_advance_line = 3,
+    DW_LNS_set_column = 5,
+    DW_LNE_end_sequence = 1,
+    DW_LNE_set_address = 2,
+};
+
+// 行番号プログラムのパラメータ
+#define LINE_BASE -5
+#define LINE_RANGE 14
+#define OPCODE_BASE 13
+
+// 伸長可能なバイト列
+typedef struct Buffer Buffer;
+struct Buffer {
+    char *data;
+    int len;
+    int cap;
+};
+
+static void buf_write(Buffer *buf, void *p, int n) {
+    while (buf->len + n > buf->cap) {
+        buf->cap = buf->cap == 0 ? 256 : buf->cap * 2;
+        buf->data = realloc(buf->data, buf->cap);
+    }
+    memcpy(buf->data + buf->len, p, n);
+    buf->len += n;
+}
+
+// 文字列を追加し、その先頭の位置を返す
+static int buf_string(Buffer *buf, char *s) {
+    int off = buf->len;
+    buf_write(buf, s, strlen(s) + 1);
+    return off;
+}
+
+static void buf_align(Buffer *buf, int align) {
+    static char zeros[16];
+    buf_write(buf, zeros, (align - buf->len % align) % align);
+}
+
+static void buf_u8(Buffer *buf, int v) {
+    char c = v;
+    buf_write(buf, &c, 1);
+}
+
+static void buf_u16(Buffer *buf, int v) {
+    uint16_t x = v;
+    buf_write(buf, &x, 2);
+}
+
+static void buf_u32(Buffer *buf, int v) {
+    uint32_t x = v;
+    buf_write(buf, &x, 4);
+}
+
+static void buf_u64(Buffer *buf, long v) {
+    uint64_t x = v;
+    buf_write(buf, &x, 8);
+}
+
+static void buf_uleb(Buffer *buf, unsigned long v) {
+    do {
+        int byte = v & 0x7f;
+        v >>= 7;
+        buf_u8(buf, v != 0 ? byte | 0x80 : byte);
+    } while (v != 0);
+}
+
+static void buf_sleb(Buffer *buf, long v) {
+    for (;;) {
+        int byte = v & 0x7f;
+        v >>= 7;
+        if ((v == 0 && !(byte & 0x40)) || (v == -1 && (byte & 0x40))) {
+            buf_u8(buf, byte);
+            return;
+        }
+        buf_u8(buf, byte | 0x80);
+    }
+}
+
+// bufの現在の位置にシンボルsymを指す再配置情報を加える
+static void add_rela(Buffer *rela, Buffer *buf, int sym, int type, long addend) {
+    Elf64_Rela r = {};
+    r.r_offset = buf->len;
+    r.r_info = ELF64_R_INFO(sym, type);
+    r.r_addend = addend;
+    buf_write(rela, &r, sizeof(r));
+}
+
+// DWARF 4の行番号表(.debug_line)を作る
+static void build_debug_line(Code *code, Buffer *line, Buffer *rela) {
+    buf_u32(line, 0); // unit_length。最後に埋める
+    buf_u16(line, 4);
+    int header_length_at = line->len;
+    buf_u32(line, 0); // header_length。ヘッダの末尾で埋める
+    int header_start = line->len;
+    buf_u8(line, 1);  // minimum_instruction_length
+    buf_u8(line, 1);  // maximum_operations_per_instruction
+    buf_u8(line, 1);  // default_is_stmt
+    buf_u8(line, LINE_BASE);
+    buf_u8(line, LINE_RANGE);
+    buf_u8(line, OPCODE_BASE);
+    static char opcode_lengths[OPCODE_BASE - 1] = {0, 1, 1, 1, 1, 0, 0, 0, 1, 0, 0, 1};
+    buf_write(line, opcode_lengths, sizeof(opcode_lengths));
+    buf_u8(line, 0); // include_directoriesは空
+    buf_string(line, DEBUG_FILE_NAME);
+    buf_uleb(line, 0); // ディレクトリ
+    buf_uleb(line, 0); // 更新時刻
+    buf_uleb(line, 0); // 大きさ
+    buf_u8(line, 0);
+    uint32_t header_length = line->len - header_start;
+    memcpy(line->data + header_length_at, &header_length, 4);
+
+    // DW_LNE_set_address: .textの先頭から始める
+    buf_u8(line, 0);
+    buf_uleb(line, 9);
+    buf_u8(line, DW_LNE_set_address);
+    add_rela(rela, line, SYM_TEXT, R_X86_64_64, 0);
+    buf_u64(line, 0);
+
+    int addr = 0;
+    int lineno = 1;
+    for (LineInfo *li = code->lines; li != NULL; li = li->next) {
+        if (li->offset > addr) {
+            buf_u8(line, DW_LNS_advance_pc);
+            buf_uleb(line, li->offset - addr);
+            addr = li->offset;
+        }
+        if (li->line != lineno) {
+            buf_u8(line, DW_LNS_advance_line);
+            buf_sleb(line, li->line - lineno);
+            lineno = li->line;
+        }
+        buf_u8(line, DW_LNS_set_column);
+        buf_uleb(line, li->col);
+        buf_u8(line, DW_LNS_copy);
+    }
+
+    buf_u8(line, DW_LNS_advance_pc);
+    buf_uleb(line, code->len - addr);
+    buf_u8(line, 0);
+    buf_uleb(line, 1);
+    buf_u8(line, DW_LNE_end_sequence);
+
+    uint32_t unit_length = line->len - 4;
+    memcpy(line->data, &unit_length, 4);
+}
+
+// 行番号表を参照するだけのコンパイル単位(.debug_info, .debug_abbrev)を作る。
+// デバッガは.debug_infoからたどって行番号表を見つける
+static void build_debug_info(Code *code, Buffer *info, Buffer *abbrev, Buffer *rela) {
+    buf_uleb(abbrev, 1);
+    buf_uleb(abbrev, DW_TAG_compile_unit);
+    buf_u8(abbrev, DW_CHILDREN_no);
+    buf_uleb(abbrev, DW_AT_producer);
+    buf_uleb(abbrev, DW_FORM_string);
+    buf_uleb(abbrev, DW_AT_language);
+    buf_uleb(abbrev, DW_FORM_data2);
+    buf_uleb(abbrev, DW_AT_name);
+    buf_uleb(abbrev, DW_FORM_string);
+    buf_uleb(abbrev, DW_AT_stmt_list);
+    buf_uleb(abbrev, DW_FORM_sec_offset);
+    buf_uleb(abbrev, DW_AT_low_pc);
+    buf_uleb(abbrev, DW_FORM_addr);
+    buf_uleb(abbrev, DW_AT_high_pc);
+    buf_uleb(abbrev, DW_FORM_data8);
+    buf_uleb(abbrev, 0);
+    buf_uleb(abbrev, 0);
+    buf_uleb(abbrev, 0);
+
+    buf_u32(info, 0); // unit_length。最後に埋める
+    buf_u16(info, 4);
+    add_rela(rela, info, SYM_DEBUG_ABBREV, R_X86_64_32, 0);
+    buf_u32(info, 0);
+    buf_u8(info, 8);  // address_size
+
+    buf_uleb(info, 1);
+    buf_string(info, "9cc");
+    buf_u16(info, DW_LANG_C99);
+    buf_string(info, DEBUG_FILE_NAME);
+    add_rela(rela, info, SYM_DEBUG_LINE, R_X86_64_32, 0);
+    buf_u32(info, 0);
+    add_rela(rela, info, SYM_TEXT, R_X86_64_64, 0);
+    buf_u64(info, 0);
+    buf_u64(info, code->len);
+
+    uint32_t unit_length = info->len - 4;
+    memcpy(info->data, &unit_length, 4);
+}
+
+// デバッグ情報のセクションをファイルに加える
+static void write_debug_section(Buffer *file, Buffer *shstrtab, Elf64_Shdr *shdr, char *name, Buffer *buf) {
+    shdr->sh_name = buf_string(shstrtab, name);
+    shdr->sh_type = SHT_PROGBITS;
+    shdr->sh_addralign = 1;
+    shdr->sh_offset = file->len;
+    shdr->sh_size = buf->len;
+    buf_write(file, buf->data, buf->len);
+}
+
+static void write_rela_section(Buffer *file, Buffer *shstrtab, Elf64_Shdr *shdr, char *name, int target, Buffer *buf) {
+    shdr->sh_name = buf_string(shstrtab, name);
+    shdr->sh_type = SHT_RELA;
+    shdr->sh_flags = SHF_INFO_LINK;
+    shdr->sh_link = SEC_SYMTAB;
+    shdr->sh_info = target;
+    shdr->sh_entsize = sizeof(Elf64_Rela);
+    shdr->sh_addralign = 8;
+    buf_align(file, 8);
+    shdr->sh_offset = file->len;
+    shdr->sh_size = buf->len;
+    buf_write(file, buf->data, buf->len);
+}
+
+// シンボル表で名前を検索する。無ければ0を返す
+static int find_symtab(Buffer *symtab, Buffer *strtab, char *name) {
+    Elf64_Sym *syms = (Elf64_Sym *)symtab->data;
+    for (int i = 1; i < symtab->len / sizeof(Elf64_Sym); i++) {
+        if (strcmp(strtab->data + syms[i].st_name, name) == 0) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+// 機械語をELF64の再配置可能オブジェクトとして書き出す
+void write_elf(Code *code, FILE *out) {
+    Buffer symtab = {};
+    Buffer strtab = {};
+    Buffer rela = {};
+    Buffer shstrtab = {};
+
+    Elf64_Sym sym = {};
+    buf_write(&symtab, &sym, sizeof(sym));
+    buf_string(&strtab, "");
+
+    // デバッグ情報の再配置に使うセクションのシンボル
+    bool debug = code->lines != NULL;
+    if (debug) {
+        int sections[] = {SEC_TEXT, SEC_DEBUG_ABBREV, SEC_DEBUG_LINE};
+        for (int i = 0; i < sizeof(sections) / sizeof(sections[0]); i++) {
+            Elf64_Sym sym = {};
+            sym.st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION);
+            sym.st_shndx = sections[i];
+            buf_write(&symtab, &sym, sizeof(sym));
+        }
+    }
+    int nlocals = symtab.len / sizeof(Elf64_Sym);
+
+    // 定義した関数。全て大域的なシンボルになる
+    for (Symbol *s = code->symbols; s != NULL; s = s->next) {
+        Elf64_Sym sym = {};
+        sym.st_name = buf_string(&strtab, s->name);
+        sym.st_info = ELF64_ST_INFO(STB_GLOBAL, STT_FUNC);
+        sym.st_shndx = SEC_TEXT;
+        sym.st_value = s->offset;
+        sym.st_size = symbol_size(code, s);
+        buf_write(&symtab, &sym, sizeof(sym));
+    }
+
+    // プログラム中の関数の呼び出しはその場で解決し、外部の関数は再配置情報として残す
+    for (Reloc *rel = code->relocs; rel != NULL; rel = rel->next) {
+        Symbol *target = find_symbol(code, rel->name);
+        if (target != NULL) {
+            int v = target->offset - (rel->offset + 4);
+            memcpy(code->data + rel->offset, &v, 4);
+            continue;
+        }
+
+        int idx = find_symtab(&symtab, &strtab, rel->name);
+        if (idx == 0) {
+            Elf64_Sym sym = {};
+            sym.st_name = buf_string(&strtab, rel->name);
+            sym.st_info = ELF64_ST_INFO(STB_GLOBAL, STT_NOTYPE);
+            sym.st_shndx = SHN_UNDEF;
+            idx = symtab.len / sizeof(Elf64_Sym);
+            buf_write(&symtab, &sym, sizeof(sym));
+        }
+
+        Elf64_Rela r = {};
+        r.r_offset = rel->offset;
+        r.r_info = ELF64_R_INFO(idx, R_X86_64_PLT32);
+        r.r_addend = -4;
+        buf_write(&rela, &r, sizeof(r));
+    }
+
+    // ファイルの中身を並べる
+    Buffer file = {};
+    Elf64_Ehdr ehdr = {};
+    buf_write(&file, &ehdr, sizeof(ehdr));
+
+    Elf64_Shdr shdr[SEC_NUM] = {};
+    buf_string(&shstrtab, "");
+
+    shdr[SEC_TEXT].sh_name = buf_string(&shstrtab, ".text");
+    shdr[SEC_TEXT].sh_type = SHT_PROGBITS;
+    shdr[SEC_TEXT].sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+    shdr[SEC_TEXT].sh_addralign = 16;
+    buf_align(&file, 16);
+    shdr[SEC_TEXT].sh_offset = file.len;
+    shdr[SEC_TEXT].sh_size = code->len;
+    buf_write(&file, code->data, code->len);
+
+    shdr[SEC_SYMTAB].sh_name = buf_string(&shstrtab, ".symtab");
+    shdr[SEC_SYMTAB].sh_type = SHT_SYMTAB;
+    shdr[SEC_SYMTAB].sh_link = SEC_STRTAB;
+    shdr[SEC_SYMTAB].sh_info = nlocals; // 最初の大域的なシンボルの番号
+    shdr[SEC_SYMTAB].sh_entsize = sizeof(Elf64_Sym);
+    shdr[SEC_SYMTAB].sh_addralign = 8;
+    buf_align(&file, 8);
+    shdr[SEC_SYMTAB].sh_offset = file.len;
+    shdr[SEC_SYMTAB].sh_size = symtab.len;
+    buf_write(&file, symtab.data, symtab.len);
+
+    shdr[SEC_STRTAB].sh_name = buf_string(&shstrtab, ".strtab");
+    shdr[SEC_STRTAB].sh_type = SHT_STRTAB;
+    shdr[SEC_STRTAB].sh_addralign = 1;
+    shdr[SEC_STRTAB].sh_offset = file.len;
+    shdr[SEC_STRTAB].sh_size = strtab.len;
+    buf_write(&file, strtab.data, strtab.len);
+
+    shdr[SEC_RELA_TEXT].sh_name = buf_string(&shstrtab, ".rela.text");
+    shdr[SEC_RELA_TEXT].sh_type = SHT_RELA;
+    shdr[SEC_RELA_TEXT].sh_flags = SHF_INFO_LINK;
+    shdr[SEC_RELA_TEXT].sh_link = SEC_SYMTAB;
+    shdr[SEC_RELA_TEXT].sh_info = SEC_TEXT;
+    shdr[SEC_RELA_TEXT].sh_entsize = sizeof(Elf64_Rela);
+    shdr[SEC_RELA_TEXT].sh_addralign = 8;
+    buf_align(&file, 8);
+    shdr[SEC_RELA_TEXT].sh_offset = file.len;
+    shdr[SEC_RELA_TEXT].sh_size = rela.len;
+    buf_write(&file, rela.data, rela.len);
+
+    // スタックを実行可能にする必要がないことをリンカに伝える
+    shdr[SEC_NOTE_STACK].sh_name = buf_string(&shstrtab, ".note.GNU-stack");
+    shdr[SEC_NOTE_STACK].sh_type = SHT_PROGBITS;
+    shdr[SEC_NOTE_STACK].sh_addralign = 1;
+    shdr[SEC_NOTE_STACK].sh_offset = file.len;
+
+    int shnum = SEC_DEBUG_ABBREV;
+    if (debug) {
+        Buffer line = {}, rela_line = {}, info = {}, abbrev = {}, rela_info = {};
+        build_debug_line(code, &line, &rela_line);
+        build_debug_info(code, &info, &abbrev, &rela_info);
+        write_debug_section(&file, &shstrtab, &shdr[SEC_DEBUG_ABBREV], ".debug_abbrev", &abbrev);
+        write_debug_section(&file, &shstrtab, &shdr[SEC_DEBUG_INFO], ".debug_info", &info);
+        write_rela_section(&file, &shstrtab, &shdr[SEC_RELA_DEBUG_INFO], ".rela.debug_info", SEC_DEBUG_INFO, &rela_info);
+        write_debug_section(&file, &shstrtab, &shdr[SEC_DEBUG_LINE], ".debug_line", &line);
+        write_rela_section(&file, &shstrtab, &shdr[SEC_RELA_DEBUG_LINE], ".rela.debug_line", SEC_DEBUG_LINE, &rela_line);
+        shnum = SEC_NUM;
+    }
+
+    shdr[SEC_SHSTRTAB].sh_name = buf_string(&shstrtab, ".shstrtab");
+    shdr[SEC_SHSTRTAB].sh_type = SHT_STRTAB;
+    shdr[SEC_SHSTRTAB].sh_addralign = 1;
+    shdr[SEC_SHSTRTAB].sh_offset = file.len;
+    shdr[SEC_SHSTRTAB].sh_size = shstrtab.len;
+    buf_write(&file, shstrtab.data, shstrtab.len);
+
+    buf_align(&file, 8);
+    int shoff = file.len;
+    buf_write(&file, shdr, shnum * sizeof(Elf64_Shdr));
+
+    Elf64_Ehdr *eh = (Elf64_Ehdr *)file.data;
+    memcpy(eh->e_ident, ELFMAG, SELFMAG);
+    eh->e_ident[EI_CLASS] = ELFCLASS64;
+    eh->e_ident[EI_DATA] = ELFDATA2LSB;
+    eh->e_ident[EI_VERSION] = EV_CURRENT;
+    eh->e_ident[EI_OSABI] = ELFOSABI_SYSV;
+    eh->e_type = ET_REL;
+    eh->e_machine = EM_X86_64;
+    eh->e_version = EV_CURRENT;
+    eh->e_shoff = shoff;
+    eh->e_ehsize = sizeof(Elf64_Ehdr);
+    eh->e_shentsize = sizeof(Elf64_Shdr);
+    eh->e_shnum = shnum;
+    eh->e_shstrndx = SEC_SHSTRTAB;
+
+    if (fwrite(file.data, 1, file.len, out) != file.len) {
+        error("オブジェクトファイルを書き出せません: %s", strerror(errno));
+    }
+}
@@ -0,0 +1,517 @@
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
+#include "9cc.h"
+
+// 命令の出力先。真ならばアセンブリではなく機械語を出力する
+bool emit_machine_code = false;
+
+// アセンブリの出力先
+FILE *output;
+
+// 機械語を出力したときの結果
+Code *code;
+
+static char *regnames[] = {
+    "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+    "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+};
+
+static char *ccnames[] = {
+    [CC_E] = "e", [CC_NE] = "ne", [CC_L] = "l", [CC_LE] = "le",
+};
+
+static char *opnames[] = {
+    [OP_ADD] = "add", [OP_SUB] = "sub", [OP_AND] = "and", [OP_CMP] = "cmp", [OP_IMUL] = "imul",
+};
+
+// ラベルの表の大きさ
+#define LABEL_TABLE_SIZE 1024
+
+typedef struct Label Label;
+struct Label {
+    Label *next;
+    char *name;
+    int offset;
+};
+
+// 未解決のジャンプ先
+typedef struct Fixup Fixup;
+struct Fixup {
+    Fixup *next;
+    char *label;
+    int offset;  // rel32の位置
+};
+
+static Label *labels[LABEL_TABLE_SIZE];
+static Fixup *fixups;
+
+// 最後に出力した位置の情報
+static LineInfo *last_line;
+
+static unsigned int hash(char *s) {
+    unsigned int h = 2166136261u;
+    for (; *s; s++) {
+        h = (h ^ (unsigned char)*s) * 16777619u;
+    }
+    return h;
+}
+
+static Label *find_label(char *name) {
+    for (Label *l = labels[hash(name) % LABEL_TABLE_SIZE]; l != NULL; l = l->next) {
+        if (strcmp(l->name, name) == 0) {
+            return l;
+        }
+    }
+    return NULL;
+}
+
+static char *format(char *fmt, va_list ap) {
+    va_list ap2;
+    va_copy(ap2, ap);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    char *s = malloc(n + 1);
+    vsnprintf(s, n + 1, fmt, ap2);
+    va_end(ap2);
+    return s;
+}
+
+static void out(int byte) {
+    if (code->len == code->cap) {
+        code->cap = code->cap == 0 ? 4096 : code->cap * 2;
+        code->data = realloc(code->data, code->cap);
+    }
+    code->data[code->len++] = byte;
+}
+
+static void out32(int v) {
+    for (int i = 0; i < 4; i++) {
+        out((v >> (i * 8)) & 0xff);
+    }
+}
+
+static bool is_imm8(int v) {
+    return -128 <= v && v <= 127;
+}
+
+// REXプレフィックスを出力する。wが偽で拡張レジスタも使わないならば省略する
+static void rex(bool w, Reg reg, Reg rm) {
+    int r = 0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3);
+    if (r != 0x40) {
+        out(r);
+    }
+}
+
+static void modrm(int mod, int reg, int rm) {
+    out((mod << 6) | ((reg & 7) << 3) | (rm & 7));
+}
+
+// [base+disp]の形のメモリオペランドを出力する
+static void mem(int reg, Reg base, int disp) {
+    int mod = (disp == 0 && (base & 7) != RBP) ? 0 : is_imm8(disp) ? 1 : 2;
+    modrm(mod, reg, base);
+    if ((base & 7) == RSP) {
+        out(0x24); // SIB: [rsp]
+    }
+    if (mod == 1) {
+        out(disp & 0xff);
+    } else if (mod == 2) {
+        out32(disp);
+    }
+}
+
+// 未解決のジャンプ先を記録し、rel32の場所を空けておく
+static void fixup(char *label) {
+    Fixup *f = calloc(1, sizeof(Fixup));
+    f->label = label;
+    f->offset = code->len;
+    f->next = fixups;
+    fixups = f;
+    out32(0);
+}
+
+static void patch32(int offset, int v) {
+    for (int i = 0; i < 4; i++) {
+        code->data[offset + i] = (v >> (i * 8)) & 0xff;
+    }
+}
+
+// 出力を開始する
+void emit_begin(void) {
+    last_line = NULL;
+    if (!emit_machine_code) {
+        fprintf(output, ".intel_syntax noprefix\n");
+        if (opt_debug_info) {
+            fprintf(output, ".file 1 \"%s\"\n", DEBUG_FILE_NAME);
+        }
+        return;
+    }
+    code = calloc(1, sizeof(Code));
+    memset(labels, 0, sizeof(labels));
+    fixups = NULL;
+}
+
+// 出力を終える。機械語の場合はジャンプ先を解決する
+void emit_end(void) {
+    if (!emit_machine_code) {
+        return;
+    }
+    for (Fixup *f = fixups; f != NULL; f = f->next) {
+        Label *l = find_label(f->label);
+        if (l == NULL) {
+            error("ラベルが定義されていません: %s", f->label);
+        }
+        patch32(f->offset, l->offset - (f->offset + 4));
+    }
+}
+
+void emit_comment(char *fmt, ...) {
+    if (emit_machine_code) {
+        return;
+    }
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(output, "  # ");
+    vfprintf(output, fmt, ap);
+    fprintf(output, "\n");
+    va_end(ap);
+}
+
+// アセンブリの1行をそのまま出力する。機械語の出力では使えない
+void emit_raw(char *fmt, ...) {
+    if (emit_machine_code) {
+        error("機械語の出力には対応していない命令です: %s", fmt);
+    }
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(output, "  ");
+    vfprintf(output, fmt, ap);
+    fprintf(output, "\n");
+    va_end(ap);
+}
+
+// これ以降の命令が入力中のtokの位置に対応することを記録する。
+// アセンブリでは.locディレクティブとなり、アセンブラが行番号表を作る
+void emit_loc(Token *tok) {
+    if (!opt_debug_info || tok == NULL) {
+        return;
+    }
+    if (last_line != NULL && last_line->line == tok->line && last_line->col == tok->col) {
+        return;
+    }
+
+    LineInfo *li = calloc(1, sizeof(LineInfo));
+    li->offset = emit_machine_code ? code->len : 0;
+    li->line = tok->line;
+    li->col = tok->col;
+    if (!emit_machine_code) {
+        fprintf(output, "  .loc 1 %d %d\n", li->line, li->col);
+    } else if (last_line == NULL) {
+        code->lines = li;
+    } else {
+        last_line->next = li;
+    }
+    last_line = li;
+}
+
+// 大域的な関数の先頭を出力する
+void emit_function(char *name) {
+    if (!emit_machine_code) {
+        fprintf(output, ".global %s\n", name);
+        fprintf(output, "%s:\n", name);
+        return;
+    }
+    Symbol *sym = calloc(1, sizeof(Symbol));
+    sym->name = name;
+    sym->offset = code->len;
+    sym->next = code->symbols;
+    code->symbols = sym;
+}
+
+void emit_label(char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    char *name = format(fmt, ap);
+    va_end(ap);
+
+    if (!emit_machine_code) {
+        fprintf(output, "%s:\n", name);
+        free(name);
+        return;
+    }
+    if (find_label(name) != NULL) {
+        error("ラベルが重複しています: %s", name);
+    }
+    Label *l = calloc(1, sizeof(Label));
+    l->name = name;
+    l->offset = code->len;
+    unsigned int h = hash(name) % LABEL_TABLE_SIZE;
+    l->next = labels[h];
+    labels[h] = l;
+}
+
+void emit_push(Reg r) {
+    if (!emit_machine_code) {
+        fprintf(output, "  push %s\n", regnames[r]);
+        return;
+    }
+    rex(false, 0, r);
+    out(0x50 + (r & 7));
+}
+
+void emit_push_imm(int val) {
+    if (!emit_machine_code) {
+        fprintf(output, "  push %d\n", val);
+        return;
+    }
+    if (is_imm8(val)) {
+        out(0x6a);
+        out(val & 0xff);
+    } else {
+        out(0x68);
+        out32(val);
+    }
+}
+
+void emit_pop(Reg r) {
+    if (!emit_machine_code) {
+        fprintf(output, "  pop %s\n", regnames[r]);
+        return;
+    }
+    rex(false, 0, r);
+    out(0x58 + (r & 7));
+}
+
+// mov dst, src
+void emit_mov(Reg dst, Reg src) {
+    if (!emit_machine_code) {
+        fprintf(output, "  mov %s, %s\n", regnames[dst], regnames[src]);
+        return;
+    }
+    rex(true, src, dst);
+    out(0x89);
+    modrm(3, src, dst);
+}
+
+// mov dst, val
+void emit_mov_imm(Reg dst, int val) {
+    if (!emit_machine_code) {
+        fprintf(output, "  mov %s, %d\n", regnames[dst], val);
+        return;
+    }
+    rex(true, 0, dst);
+    out(0xc7);
+    modrm(3, 0, dst);
+    out32(val);
+}
+
+// mov dst, [base]
+void emit_load(Reg dst, Reg base) {
+    if (!emit_machine_code) {
+        fprintf(output, "  mov %s, [%s]\n", regnames[dst], regnames[base]);
+        return;
+    }
+    rex(true, dst, base);
+    out(0x8b);
+    mem(dst, base, 0);
+}
+
+// mov [base], src
+void emit_store(Reg base, Reg src) {
+    if (!emit_machine_code) {
+        fprintf(output, "  mov [%s], %s\n", regnames[base], regnames[src]);
+        return;
+    }
+    rex(true, src, base);
+    out(0x89);
+    mem(src, base, 0);
+}
+
+// mov dst, [rbp-offset]
+void emit_load_local(Reg dst, int offset) {
+    if (!emit_machine_code) {
+        fprintf(output, "  mov %s, [rbp-%d]\n", regnames[dst], offset);
+        return;
+    }
+    rex(true, dst, RBP);
+    out(0x8b);
+    mem(dst, RBP, -offset);
+}
+
+// mov [rbp-offset], src
+void emit_store_local(int offset, Reg src) {
+    if (!emit_machine_code) {
+        fprintf(output, "  mov [rbp-%d], %s\n", offset, regnames[src]);
+        return;
+    }
+    rex(true, src, RBP);
+    out(0x89);
+    mem(src, RBP, -offset);
+}
+
+// lea dst, [rbp-offset]
+void emit_lea_local(Reg dst, int offset) {
+    if (!emit_machine_code) {
+        fprintf(output, "  lea %s, [rbp-%d]\n", regnames[dst], offset);
+        return;
+    }
+    rex(true, dst, RBP);
+    out(0x8d);
+    mem(dst, RBP, -offset);
+}
+
+// op dst, src
+void emit_op(ArithOp op, Reg dst, Reg src) {
+    if (!emit_machine_code) {
+        fprintf(output, "  %s %s, %s\n", opnames[op], regnames[dst], regnames[src]);
+        return;
+    }
+    static int opcodes[] = {
+        [OP_ADD] = 0x01, [OP_SUB] = 0x29, [OP_AND] = 0x21, [OP_CMP] = 0x39,
+    };
+    if (op == OP_IMUL) {
+        rex(true, dst, src);
+        out(0x0f);
+        out(0xaf);
+        modrm(3, dst, src);
+        return;
+    }
+    rex(true, src, dst);
+    out(opcodes[op]);
+    modrm(3, src, dst);
+}
+
+// op dst, imm
+void emit_op_imm(ArithOp op, Reg dst, int imm) {
+    if (!emit_machine_code) {
+        fprintf(output, "  %s %s, %d\n", opnames[op], regnames[dst], imm);
+        return;
+    }
+    // ModR/Mのregフィールドで演算を区別する
+    static int exts[] = {
+        [OP_ADD] = 0, [OP_SUB] = 5, [OP_AND] = 4, [OP_CMP] = 7,
+    };
+    if (op == OP_IMUL) {
+        error("imulの即値形式には対応していません");
+    }
+    rex(true, 0, dst);
+    if (is_imm8(imm)) {
+        out(0x83);
+        modrm(3, exts[op], dst);
+        out(imm & 0xff);
+    } else {
+        out(0x81);
+        modrm(3, exts[op], dst);
+        out32(imm);
+    }
+}
+
+// cqo
+void emit_cqo(void) {
+    if (!emit_machine_code) {
+        fprintf(output, "  cqo\n");
+        return;
+    }
+    out(0x48);
+    out(0x99);
+}
+
+// idiv r
+void emit_idiv(Reg r) {
+    if (!emit_machine_code) {
+        fprintf(output, "  idiv %s\n", regnames[r]);
+        return;
+    }
+    rex(true, 0, r);
+    out(0xf7);
+    modrm(3, 7, r);
+}
+
+// 条件が成り立つならば1を、そうでなければ0をraxに入れる
+void emit_setcc(CondCode cc) {
+    if (!emit_machine_code) {
+        fprintf(output, "  set%s al\n", ccnames[cc]);
+        fprintf(output, "  movzb rax, al\n");
+        return;
+    }
+    out(0x0f);
+    out(0x90 | cc);
+    out(0xc0);
+    out(0x48);
+    out(0x0f);
+    out(0xb6);
+    out(0xc0);
+}
+
+void emit_jmp(char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    char *label = format(fmt, ap);
+    va_end(ap);
+
+    if (!emit_machine_code) {
+        fprintf(output, "  jmp %s\n", label);
+        free(label);
+        return;
+    }
+    out(0xe9);
+    fixup(label);
+}
+
+void emit_jcc(CondCode cc, char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    char *label = format(fmt, ap);
+    va_end(ap);
+
+    if (!emit_machine_code) {
+        fprintf(output, "  j%s %s\n", ccnames[cc], label);
+        free(label);
+        return;
+    }
+    out(0x0f);
+    out(0x80 | cc);
+    fixup(label);
+}
+
+// 関数を呼び出す。機械語の場合は呼び出し先を再配置情報として記録する
+void emit_call(char *name) {
+    if (!emit_machine_code) {
+        fprintf(output, "  call %s\n", name);
+        return;
+    }
+    out(0xe8);
+    Reloc *rel = calloc(1, sizeof(Reloc));
+    rel->name = name;
+    rel->offset = code->len;
+    rel->next = code->relocs;
+    code->relocs = rel;
+    out32(0);
+}
+
+void emit_ret(void) {
+    if (!emit_machine_code) {
+        fprintf(output, "  ret\n");
+        return;
+    }
+    out(0xc3);
+}
+
+// 関数を名前で検索する。無ければNULLを返す。
+Symbol *find_symbol(Code *code, char *name) {
+    for (Symbol *sym = code->symbols; sym != NULL; sym = sym->next) {
+        if (strcmp(sym->name, name) == 0) {
+            return sym;
+        }
+    }
+    return NULL;
+}
+
+// 関数の大きさを、次の関数の先頭までの距離として求める
+int symbol_size(Code *code, Symbol *sym) {
+    int end = code->len;
+    for (Symbol *s = code->symbols; s != NULL; s = s->next) {
+        if (s->offset > sym->offset && s->offset < end) {
+            end = s->offset;
+        }
+    }
+    return end - sym->offset;
+}
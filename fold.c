@@ -0,0 +1,385 @@
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
+#include "9cc.h"
+
+// 1回の呼び出しの評価に費してよいノードの評価回数
+#define FOLD_STEP_LIMIT 1000000
+
+// 評価中の関数呼び出しの深さの上限
+#define FOLD_DEPTH_LIMIT 1000
+
+// 評価中の関数のローカル変数の値
+typedef struct Value Value;
+struct Value {
+    Value *next;
+    LVar *var;
+    long val;
+};
+
+// 文を実行した結果
+typedef enum {
+    EV_NEXT,   // 次の文に進む
+    EV_RETURN, // returnした
+    EV_FAIL,   // コンパイル時には評価できない
+} EvalStatus;
+
+typedef struct Frame Frame;
+struct Frame {
+    Value *values;
+    long retval;
+};
+
+static Function *functions;
+static int steps;
+static int depth;
+
+static bool eval_function(Function *fn, long *result);
+
+static Value *find_value(Frame *frame, LVar *var) {
+    for (Value *v = frame->values; v != NULL; v = v->next) {
+        if (v->var == var) {
+            return v;
+        }
+    }
+    return NULL;
+}
+
+// 式の評価で、子の評価を待っているノード
+typedef struct EvalFrame EvalFrame;
+struct EvalFrame {
+    Node *node;
+    int state;  // 処理の段階。子を1つ積むたびに進む
+    Node *arg;  // 次に評価する引数(ND_FUNCALL)
+};
+
+// 式の評価に使う明示的なスタックと、評価した値のスタック。
+// 入れ子の深さはヒープの大きさだけで制限される
+static EvalFrame *eval_frames;
+static int neval_frames;
+static int cap_eval_frames;
+static long *eval_values;
+static int neval_values;
+static int cap_eval_values;
+
+static void push_eval_frame(Node *node) {
+    if (neval_frames == cap_eval_frames) {
+        cap_eval_frames = cap_eval_frames == 0 ? 64 : cap_eval_frames * 2;
+        eval_frames = realloc(eval_frames, sizeof(EvalFrame) * cap_eval_frames);
+    }
+    eval_frames[neval_frames++] = (EvalFrame){node, 0, node->args};
+}
+
+static void push_eval_value(long val) {
+    if (neval_values == cap_eval_values) {
+        cap_eval_values = cap_eval_values == 0 ? 64 : cap_eval_values * 2;
+        eval_values = realloc(eval_values, sizeof(long) * cap_eval_values);
+    }
+    eval_values[neval_values++] = val;
+}
+
+// 二項演算を計算する。生成コードと同じく64ビットの符号付き整数として計算する
+static bool eval_binary(NodeKind kind, long l, long r, long *result) {
+    switch (kind) {
+        case ND_ADD:
+            *result = (long)((unsigned long)l + (unsigned long)r);
+            return true;
+        case ND_SUB:
+            *result = (long)((unsigned long)l - (unsigned long)r);
+            return true;
+        case ND_MUL:
+            *result = (long)((unsigned long)l * (unsigned long)r);
+            return true;
+        case ND_DIV:
+            // ゼロ除算などは実行時の振る舞いに任せる
+            if (r == 0 || (l == LONG_MIN && r == -1)) {
+                return false;
+            }
+            *result = l / r;
+            return true;
+        case ND_EQ:
+            *result = l == r;
+            return true;
+        case ND_NE:
+            *result = l != r;
+            return true;
+        case ND_LT:
+            *result = l < r;
+            return true;
+        case ND_LE:
+            *result = l <= r;
+            return true;
+    }
+    return false;
+}
+
+// 式を再帰を使わずに評価する。評価できなければ偽を返す。
+// 呼び出された関数の評価はeval_functionを介して再入する
+static bool eval_expr(Frame *frame, Node *node, long *result) {
+    int base = neval_frames;
+    int vbase = neval_values;
+    push_eval_frame(node);
+
+    while (neval_frames > base) {
+        EvalFrame *f = &eval_frames[neval_frames - 1];
+        node = f->node;
+        int state = f->state++;
+        if (state == 0 && ++steps > FOLD_STEP_LIMIT) {
+            goto fail;
+        }
+
+        long l, r;
+        switch (node->kind) {
+            case ND_NUM:
+                push_eval_value(node->val);
+                neval_frames--;
+                continue;
+            case ND_LVAR: {
+                // 初期化されていない変数の値は実行時まで分からない
+                Value *v = find_value(frame, node->var);
+                if (v == NULL) {
+                    goto fail;
+                }
+                push_eval_value(v->val);
+                neval_frames--;
+                continue;
+            }
+            case ND_ASSIGN: {
+                if (state == 0) {
+                    push_eval_frame(node->rhs);
+                    continue;
+                }
+                // 右辺の値をそのまま代入式の値とする
+                Value *v = find_value(frame, node->lhs->var);
+                if (v == NULL) {
+                    v = calloc(1, sizeof(Value));
+                    v->var = node->lhs->var;
+                    v->next = frame->values;
+                    frame->values = v;
+                }
+                v->val = eval_values[neval_values - 1];
+                neval_frames--;
+                continue;
+            }
+            case ND_FUNCALL:
+                // 呼び出し先は引数を受け取らないが、引数の副作用は反映させる。値は捨てる
+                if (state > 0) {
+                    neval_values--;
+                }
+                if (f->arg != NULL) {
+                    Node *arg = f->arg;
+                    f->arg = arg->next;
+                    push_eval_frame(arg);
+                    continue;
+                }
+                if (!eval_function(find_function(functions, node->funcname), &r)) {
+                    goto fail;
+                }
+                neval_frames--;
+                push_eval_value(r);
+                continue;
+        }
+
+        // 二項演算
+        if (state == 0) {
+            push_eval_frame(node->lhs);
+            continue;
+        }
+        if (state == 1) {
+            push_eval_frame(node->rhs);
+            continue;
+        }
+        r = eval_values[--neval_values];
+        l = eval_values[--neval_values];
+        if (!eval_binary(node->kind, l, r, &l)) {
+            goto fail;
+        }
+        push_eval_value(l);
+        neval_frames--;
+    }
+
+    *result = eval_values[--neval_values];
+    return true;
+
+fail:
+    neval_frames = base;
+    neval_values = vbase;
+    return false;
+}
+
+// 文を実行する
+static EvalStatus eval_stmt(Frame *frame, Node *node) {
+    long v;
+    EvalStatus st;
+
+    switch (node->kind) {
+        case ND_RETURN:
+            if (!eval_expr(frame, node->lhs, &frame->retval)) {
+                return EV_FAIL;
+            }
+            return EV_RETURN;
+        case ND_EXPR_STMT:
+            return eval_expr(frame, node->lhs, &v) ? EV_NEXT : EV_FAIL;
+        case ND_IF:
+            if (!eval_expr(frame, node->cond, &v)) {
+                return EV_FAIL;
+            }
+            if (v != 0) {
+                return eval_stmt(frame, node->then);
+            }
+            if (node->els != NULL) {
+                return eval_stmt(frame, node->els);
+            }
+            return EV_NEXT;
+        case ND_WHILE:
+            for (;;) {
+                if (!eval_expr(frame, node->cond, &v)) {
+                    return EV_FAIL;
+                }
+                if (v == 0) {
+                    return EV_NEXT;
+                }
+                st = eval_stmt(frame, node->body);
+                if (st != EV_NEXT) {
+                    return st;
+                }
+            }
+        case ND_FOR:
+            if (node->init != NULL && (st = eval_stmt(frame, node->init)) != EV_NEXT) {
+                return st;
+            }
+            for (;;) {
+                if (node->cond != NULL) {
+                    if (!eval_expr(frame, node->cond, &v)) {
+                        return EV_FAIL;
+                    }
+                    if (v == 0) {
+                        return EV_NEXT;
+                    }
+                }
+                st = eval_stmt(frame, node->body);
+                if (st != EV_NEXT) {
+                    return st;
+                }
+                if (node->inc != NULL && (st = eval_stmt(frame, node->inc)) != EV_NEXT) {
+                    return st;
+                }
+                // 条件のない無限ループもここで打ち切られる
+                if (steps > FOLD_STEP_LIMIT) {
+                    return EV_FAIL;
+                }
+            }
+        case ND_BLOCK:
+            for (Node *n = node->block; n != NULL; n = n->next) {
+                st = eval_stmt(frame, n);
+                if (st != EV_NEXT) {
+                    return st;
+                }
+            }
+            return EV_NEXT;
+    }
+    return EV_FAIL;
+}
+
+// 関数を評価する。純粋な関数でなければならない
+static bool eval_function(Function *fn, long *result) {
+    if (fn == NULL || !fn->pure || depth >= FOLD_DEPTH_LIMIT) {
+        return false;
+    }
+
+    // returnせずに関数の末尾に到達したときの戻り値は不定である
+    Frame frame = {};
+    EvalStatus st = EV_FAIL;
+    depth++;
+    for (Node *n = fn->nodes; n != NULL; n = n->next) {
+        st = eval_stmt(&frame, n);
+        if (st != EV_NEXT) {
+            break;
+        }
+    }
+    depth--;
+
+    if (st != EV_RETURN) {
+        return false;
+    }
+    *result = frame.retval;
+    return true;
+}
+
+static bool is_impure_call(Node *node, void *arg) {
+    if (node->kind != ND_FUNCALL) {
+        return false;
+    }
+    Function *fn = find_function(functions, node->funcname);
+    return fn == NULL || !fn->pure;
+}
+
+// 外部の関数や純粋でない関数の呼び出しを含むか調べる
+static bool has_impure_call(Node *node) {
+    return walk_nodes(node, false, is_impure_call, NULL);
+}
+
+// 純粋な関数を求める。ローカル変数と算術演算、純粋な関数の呼び出しだけからなる関数を純粋とする。
+// 全ての関数を純粋と仮定し、外部の関数や純粋でない関数を呼ぶ関数を不動点に達するまで取り除く。
+static void classify_pure(Function *prog) {
+    for (Function *fn = prog; fn != NULL; fn = fn->next) {
+        fn->pure = true;
+    }
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (Function *fn = prog; fn != NULL; fn = fn->next) {
+            if (!fn->pure) {
+                continue;
+            }
+            for (Node *n = fn->nodes; n != NULL; n = n->next) {
+                if (has_impure_call(n)) {
+                    fn->pure = false;
+                    changed = true;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+// 定数引数による純粋な関数の呼び出しを、その結果で置き換える。
+// 引数を先に畳み込めるよう、子を親より先に訪れる
+static bool fold_call(Node *node, void *arg) {
+    if (node->kind != ND_FUNCALL) {
+        return false;
+    }
+    for (Node *a = node->args; a != NULL; a = a->next) {
+        if (a->kind != ND_NUM) {
+            return false;
+        }
+    }
+
+    long result;
+    steps = 0;
+    depth = 0;
+    if (!eval_function(find_function(functions, node->funcname), &result) || result < INT_MIN || INT_MAX < result) {
+        return false;
+    }
+
+    // 引数のリストの中にあることもあるのでnextは保つ。位置の報告や-gのためにtokも保つ
+    Node *next = node->next;
+    Token *tok = node->tok;
+    memset(node, 0, sizeof(Node));
+    node->kind = ND_NUM;
+    node->val = result;
+    node->next = next;
+    node->tok = tok;
+    return false;
+}
+
+// 純粋な関数の呼び出しのコンパイル時評価のエントリポイント
+void fold_pure_calls(Function *prog) {
+    functions = prog;
+    classify_pure(prog);
+
+    for (Function *fn = prog; fn != NULL; fn = fn->next) {
+        for (Node *n = fn->nodes; n != NULL; n = n->next) {
+            walk_nodes(n, true, fold_call, NULL);
+        }
+    }
+}
@@ -3,204 +3,395 @@
 
 static void gen_lval(Node *node);
 static void gen(Node *node);
+static void gen_expr(Node *node);
 
 static unsigned int labelnumber = 0;
 
-static char *argregs[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
+static Reg argregs[] = {RDI, RSI, RDX, RCX, R8, R9};
 
 static char *funcname;
 
+// インライン展開中の本体の番号。returnはその末尾へ飛ぶ。展開中でなければ-1
+static int inline_ln = -1;
+
+// 実行頻度が低いため関数の末尾に追い出したthen節
+typedef struct ColdBlock ColdBlock;
+struct ColdBlock {
+    ColdBlock *next;
+    Node *node;     // ND_IF
+    int ln;         // ifのラベル番号
+    int br;         // 計測する分岐の番号
+    int inline_ln;  // 追い出した時点でのinline_ln
+};
+
+static ColdBlock *cold_blocks;
+
 static void gen_lval(Node *node) {
     if (node->kind != ND_LVAR) {
         error("代入の左辺値が変数ではありません");
     }
 
-    printf("  # gen_lval\n");
-    printf("  lea rax, [rbp-%d]\n", node->var->offset);
-    printf("  push rax\n");
+    emit_comment("gen_lval");
+    emit_lea_local(RAX, node->var->offset);
+    emit_push(RAX);
+}
+
+// then節を関数の末尾に追い出し、条件が偽の側を分岐なしで実行できるようにする
+static void gen_cold_if(Node *node, int ln, int br) {
+    emit_comment("ND_IF(cold then)");
+    gen(node->cond);
+    emit_pop(RAX);
+    emit_op_imm(OP_CMP, RAX, 0);
+    emit_jcc(CC_NE, ".L.cold.%s.%d", funcname, ln);
+    if (node->els != NULL) {
+        gen(node->els);
+    }
+    emit_label(".L.endif.%s.%d", funcname, ln);
+
+    ColdBlock *cb = calloc(1, sizeof(ColdBlock));
+    cb->node = node;
+    cb->ln = ln;
+    cb->br = br;
+    cb->inline_ln = inline_ln;
+    cb->next = cold_blocks;
+    cold_blocks = cb;
+}
+
+// 追い出したthen節を出力する。then節の中でさらに追い出されたものも含む
+static void gen_cold_blocks(void) {
+    while (cold_blocks != NULL) {
+        ColdBlock *cb = cold_blocks;
+        cold_blocks = cb->next;
+
+        inline_ln = cb->inline_ln;
+        emit_label(".L.cold.%s.%d", funcname, cb->ln);
+        if (cb->br >= 0) {
+            instrument_count(cb->br, 1);
+        }
+        gen(cb->node->then);
+        emit_jmp(".L.endif.%s.%d", funcname, cb->ln);
+    }
+    inline_ln = -1;
+}
+
+// インライン展開した呼び出しを出力する。
+// 引数は副作用のためだけに評価し、returnの値をraxに入れて末尾へ飛ぶ
+static void gen_inline(Node *node) {
+    emit_comment("inline %s", node->funcname);
+    for (Node *arg = node->args; arg != NULL; arg = arg->next) {
+        gen(arg);
+        emit_op_imm(OP_ADD, RSP, 8);
+    }
+
+    int saved = inline_ln;
+    inline_ln = labelnumber++;
+    for (Node *n = node->inlined; n != NULL; n = n->next) {
+        gen(n);
+    }
+    emit_label(".L.inline.end.%s.%d", funcname, inline_ln);
+    emit_push(RAX);
+    inline_ln = saved;
+}
+
+// 引数をスタックに積み終えた関数呼び出しを出力する
+static void gen_call(Node *node, int nargs) {
+    // 引数は右からスタックに積まれているから、正しい順にpopする必要がある
+    for (int i = nargs - 1; i >= 0; i--) {
+        emit_pop(argregs[i]);
+    }
+
+    // 関数を呼ぶ際にはRSPを16バイト境界にアラインしなければならない
+    int ln = labelnumber++;
+    emit_mov(RAX, RSP);
+    emit_op_imm(OP_AND, RAX, 15); // 16の倍数ならば下位4ビットは必ず0である
+    emit_jcc(CC_NE, ".L.call.%s.%d", funcname, ln);
+    // 可変長引数を取る関数を呼ぶときは、XMMレジスタに入れて渡す浮動小数点数の個数をalに入れなくてはならない
+    emit_mov_imm(RAX, 0);
+    emit_call(node->funcname);
+    emit_jmp(".L.endcall.%s.%d", funcname, ln);
+    emit_label(".L.call.%s.%d", funcname, ln);
+    emit_op_imm(OP_SUB, RSP, 8); // スタックは下位アドレス方向に伸びるから
+    emit_mov_imm(RAX, 0);
+    emit_call(node->funcname);
+    emit_op_imm(OP_ADD, RSP, 8);
+    emit_label(".L.endcall.%s.%d", funcname, ln);
+    emit_push(RAX);
+}
+
+// 両辺をスタックに積み終えた二項演算を出力する
+static void gen_binary(Node *node) {
+    emit_comment("%s:%d", __FILE__, __LINE__);
+    emit_pop(RDI);
+    emit_pop(RAX);
+
+    switch (node->kind) {
+        case ND_ADD:
+            emit_comment("ND_ADD");
+            emit_op(OP_ADD, RAX, RDI);
+            break;
+        case ND_SUB:
+            emit_comment("ND_SUB");
+            emit_op(OP_SUB, RAX, RDI);
+            break;
+        case ND_MUL:
+            emit_comment("ND_MUL");
+            emit_op(OP_IMUL, RAX, RDI);
+            break;
+        case ND_DIV:
+            emit_comment("ND_NIV");
+            emit_cqo();
+            emit_idiv(RDI);
+            break;
+        case ND_EQ:
+            emit_comment("ND_EQ");
+            emit_op(OP_CMP, RAX, RDI);
+            emit_setcc(CC_E);
+            break;
+        case ND_NE:
+            emit_comment("ND_NE");
+            emit_op(OP_CMP, RAX, RDI);
+            emit_setcc(CC_NE);
+            break;
+        case ND_LT:
+            emit_comment("ND_LT");
+            emit_op(OP_CMP, RAX, RDI);
+            emit_setcc(CC_L);
+            break;
+        case ND_LE:
+            emit_comment("ND_LE");
+            emit_op(OP_CMP, RAX, RDI);
+            emit_setcc(CC_LE);
+            break;
+    }
+
+    emit_push(RAX);
+}
+
+// 式のコード生成で、子の処理を待っているノード
+typedef struct GenFrame GenFrame;
+struct GenFrame {
+    Node *node;
+    int state;  // 処理の段階。子を1つ積むたびに進む
+    Node *arg;  // 次に評価する引数(ND_FUNCALL)
+    int nargs;  // 評価した引数の数(ND_FUNCALL)
+};
+
+// 式のコード生成に使う明示的なスタック。入れ子の深さはヒープの大きさだけで制限される
+static GenFrame *frames;
+static int nframes;
+static int cap_frames;
+
+static void push_frame(Node *node) {
+    if (nframes == cap_frames) {
+        cap_frames = cap_frames == 0 ? 64 : cap_frames * 2;
+        frames = realloc(frames, sizeof(GenFrame) * cap_frames);
+    }
+    frames[nframes++] = (GenFrame){node, 0, node->args, 0};
+}
+
+static bool is_reg_var(Node *node) {
+    return node->kind == ND_LVAR && node->var->in_reg;
+}
+
+// 式を評価して結果をスタックに積むコードを、再帰を使わずに出力する。
+// インライン展開した呼び出しの本体は文なので、genを介して再入する
+static void gen_expr(Node *node) {
+    int base = nframes;
+    push_frame(node);
+
+    while (nframes > base) {
+        GenFrame *f = &frames[nframes - 1];
+        node = f->node;
+        int state = f->state++;
+
+        switch (node->kind) {
+            case ND_NUM:
+                emit_comment("ND_NUM");
+                emit_loc(node->tok);  // 畳み込んだ関数呼び出しならば、その位置を持つ
+                emit_push_imm(node->val);
+                nframes--;
+                continue;
+            case ND_LVAR:
+                emit_comment("ND_LVAR");
+                if (node->var->in_reg) {
+                    emit_push(node->var->reg);
+                } else {
+                    gen_lval(node);
+                    emit_pop(RAX);
+                    emit_load(RAX, RAX);
+                    emit_push(RAX);
+                }
+                nframes--;
+                continue;
+            case ND_ASSIGN:
+                if (state == 0) {
+                    emit_comment("ND_ASSIGN");
+                    if (!is_reg_var(node->lhs)) {
+                        gen_lval(node->lhs);
+                    }
+                    push_frame(node->rhs);
+                    continue;
+                }
+                emit_pop(RDI);
+                if (is_reg_var(node->lhs)) {
+                    emit_mov(node->lhs->var->reg, RDI);
+                } else {
+                    emit_pop(RAX);
+                    emit_store(RAX, RDI);
+                }
+                emit_push(RDI);
+                nframes--;
+                continue;
+            case ND_FUNCALL:
+                if (state == 0) {
+                    emit_loc(node->tok);
+                    if (node->inlined != NULL) {
+                        nframes--;
+                        gen_inline(node);
+                        continue;
+                    }
+                }
+                if (f->arg != NULL) {
+                    Node *arg = f->arg;
+                    f->arg = arg->next;
+                    f->nargs++;
+                    push_frame(arg);
+                    continue;
+                }
+                gen_call(node, f->nargs);
+                nframes--;
+                continue;
+        }
+
+        // 二項演算
+        if (state == 0) {
+            push_frame(node->lhs);
+        } else if (state == 1) {
+            push_frame(node->rhs);
+        } else {
+            gen_binary(node);
+            nframes--;
+        }
+    }
 }
 
 void gen(Node *node) {
     int ln;
+    int br; // 計測する分岐の番号
+    emit_loc(node->tok);
     switch (node->kind) {
-        case ND_NUM:
-            printf("  # ND_NUM\n");
-            printf("  push %d\n", node->val);
-            return;
-        case ND_LVAR:
-            printf("  # ND_LVAR\n");
-            gen_lval(node);
-            printf("  pop rax\n");
-            printf("  mov rax, [rax]\n");
-            printf("  push rax\n");
-            return;
-        case ND_ASSIGN:
-            printf("  # ND_ASSIGN\n");
-            gen_lval(node->lhs);
-            gen(node->rhs);
-
-            printf("  pop rdi\n");
-            printf("  pop rax\n");
-            printf("  mov [rax], rdi\n");
-            printf("  push rdi\n");
-            return;
         case ND_EXPR_STMT:
-            printf("  # ND_EXPR_STMT\n");
+            emit_comment("ND_EXPR_STMT");
             gen(node->lhs);
-            printf("  add rsp, 8\n");
+            emit_op_imm(OP_ADD, RSP, 8);
             return;
         case ND_IF:
             ln = labelnumber++;
+            br = -1;
+            if (opt_instrument_branches) {
+                br = instrument_branch("if", node);
+                instrument_count(br, 0);
+            }
+            if (profile_loaded && pgo_then_is_cold(node)) {
+                gen_cold_if(node, ln, br);
+                return;
+            }
             if (node->els == NULL) {
-                printf("  # ND_IF(els==NULL)\n");
+                emit_comment("ND_IF(els==NULL)");
                 gen(node->cond);
-                printf("  pop rax\n");
-                printf("  cmp rax, 0\n");
-                printf("  je .L.endif.%d\n", ln);
+                emit_pop(RAX);
+                emit_op_imm(OP_CMP, RAX, 0);
+                emit_jcc(CC_E, ".L.endif.%s.%d", funcname, ln);
+                if (br >= 0) {
+                    instrument_count(br, 1);
+                }
                 gen(node->then);
-                printf(".L.endif.%d:\n", ln);
+                emit_label(".L.endif.%s.%d", funcname, ln);
             } else {
-                printf("  # ND_IF(els!=NULL)\n");
+                emit_comment("ND_IF(els!=NULL)");
                 gen(node->cond);
-                printf("  pop rax\n");
-                printf("  cmp rax, 0\n");
-                printf("  je .L.else.%d\n", ln);
+                emit_pop(RAX);
+                emit_op_imm(OP_CMP, RAX, 0);
+                emit_jcc(CC_E, ".L.else.%s.%d", funcname, ln);
+                if (br >= 0) {
+                    instrument_count(br, 1);
+                }
                 gen(node->then);
-                printf("  jmp .L.endif.%d\n", ln);
-                printf(".L.else.%d:\n", ln);
+                emit_jmp(".L.endif.%s.%d", funcname, ln);
+                emit_label(".L.else.%s.%d", funcname, ln);
                 gen(node->els);
-                printf(".L.endif.%d:\n", ln);
+                emit_label(".L.endif.%s.%d", funcname, ln);
             }
             return;
         case ND_WHILE:
             ln = labelnumber++;
-            printf(".L.while.%d:\n", ln);
+            br = -1;
+            if (opt_instrument_branches) {
+                br = instrument_branch("while", node);
+                instrument_count(br, 0);
+            }
+            emit_label(".L.while.%s.%d", funcname, ln);
             gen(node->cond);
-            printf("  pop rax\n");
-            printf("  cmp rax, 0\n");
-            printf("  je .L.endwhile.%d\n", ln);
+            emit_pop(RAX);
+            emit_op_imm(OP_CMP, RAX, 0);
+            emit_jcc(CC_E, ".L.endwhile.%s.%d", funcname, ln);
+            if (br >= 0) {
+                instrument_count(br, 1);
+            }
             gen(node->body);
-            printf("  jmp .L.while.%d\n", ln);
-            printf(".L.endwhile.%d:\n", ln);
+            emit_jmp(".L.while.%s.%d", funcname, ln);
+            emit_label(".L.endwhile.%s.%d", funcname, ln);
             return;
         case ND_FOR:
             ln = labelnumber++;
+            br = -1;
+            if (opt_instrument_branches) {
+                br = instrument_branch("for", node);
+                instrument_count(br, 0);
+            }
             if (node->init != NULL) {
                 gen(node->init);
             }
-            printf(".L.for.%d:\n", ln);
+            emit_label(".L.for.%s.%d", funcname, ln);
             if (node->cond != NULL) {
                 gen(node->cond);
-                printf("  pop rax\n");
-                printf("  cmp rax, 0\n");
-                printf("  je .L.endfor.%d\n", ln);
+                emit_pop(RAX);
+                emit_op_imm(OP_CMP, RAX, 0);
+                emit_jcc(CC_E, ".L.endfor.%s.%d", funcname, ln);
+            }
+            if (br >= 0) {
+                instrument_count(br, 1);
             }
             gen(node->body);
             if (node->inc != NULL) {
                 gen(node->inc);
             }
-            printf("  jmp .L.for.%d\n", ln);
-            printf(".L.endfor.%d:\n", ln);
+            emit_jmp(".L.for.%s.%d", funcname, ln);
+            emit_label(".L.endfor.%s.%d", funcname, ln);
             return;
         case ND_BLOCK:
             for (Node *n = node->block; n != NULL; n = n->next) {
                 gen(n);
             }
             return;
-        case ND_FUNCALL: { // 変数宣言は文ではないためラベルがつけられない
-            int nargs = 0;
-            for (Node *arg = node->args; arg != NULL; arg = arg->next) {
-                gen(arg);
-                nargs++;
-            }
-            // 引数は右からスタックに積まれているから、正しい順にpopする必要がある
-            for (int i = nargs - 1; i >= 0; i--) {
-                printf("  pop %s\n", argregs[i]);
-            }
-
-            // 関数を呼ぶ際にはRSPを16バイト境界にアラインしなければならない
-            int ln = labelnumber++;
-            printf("  mov rax, rsp\n");
-            printf("  and rax, 15\n"); // 16の倍数ならば下位4ビットは必ず0である
-            printf("  jnz .L.call.%d\n", ln);
-            // 可変長引数を取る関数を呼ぶときは、XMMレジスタに入れて渡す浮動小数点数の個数をalに入れなくてはならない
-            printf("  mov rax, 0\n");
-            printf("  call %s\n", node->funcname);
-            printf("  jmp .L.endcall.%d\n", ln);
-            printf(".L.call.%d:\n", ln);
-            printf("  sub rsp, 8\n"); // スタックは下位アドレス方向に伸びるから
-            printf("  mov rax, 0\n");
-            printf("  call %s\n", node->funcname);
-            printf("  add rsp, 8\n");
-            printf(".L.endcall.%d:\n", ln);
-            printf("  push rax\n");
-            return;
-        }
         case ND_RETURN:
             gen(node->lhs);
-            printf("  # ND_RETURN\n");
-            printf("  pop rax\n");
-            printf("  jmp .L.return.%s\n", funcname);
+            emit_comment("ND_RETURN");
+            emit_pop(RAX);
+            if (inline_ln >= 0) {
+                emit_jmp(".L.inline.end.%s.%d", funcname, inline_ln);
+                return;
+            }
+            emit_jmp(".L.return.%s", funcname);
             return;
     }
 
-    gen(node->lhs);
-    gen(node->rhs);
-
-    printf("  # %s:%d\n", __FILE__, __LINE__);
-    printf("  pop rdi\n");
-    printf("  pop rax\n");
-
-    switch (node->kind) {
-        case ND_ADD:
-            printf("  # ND_ADD\n");
-            printf("  add rax, rdi\n");
-            break;
-        case ND_SUB:
-            printf("  # ND_SUB\n");
-            printf("  sub rax, rdi\n");
-            break;
-        case ND_MUL:
-            printf("  # ND_MUL\n");
-            printf("  imul rax, rdi\n");
-            break;
-        case ND_DIV:
-            printf("  # ND_NIV\n");
-            printf("  cqo\n");
-            printf("  idiv rdi\n");
-            break;
-        case ND_EQ:
-            printf("  # ND_EQ\n");
-            printf("  cmp rax, rdi\n");
-            printf("  sete al\n");
-            printf("  movzb rax, al\n");
-            break;
-        case ND_NE:
-            printf("  # ND_NE\n");
-            printf("  cmp rax, rdi\n");
-            printf("  setne al\n");
-            printf("  movzb rax, al\n");
-            break;
-        case ND_LT:
-            printf("  # ND_LT\n");
-            printf("  cmp rax, rdi\n");
-            printf("  setl al\n");
-            printf("  movzb rax, al\n");
-            break;
-        case ND_LE:
-            printf("  # ND_LE\n");
-            printf("  cmp rax, rdi\n");
-            printf("  setle al\n");
-            printf("  movzb rax, al\n");
-            break;
-    }
-
-    printf("  push rax\n");
+    // 残りは式である
+    gen_expr(node);
 }
 
-// コード生成器のエントリポイント
-void gencode(Function *prog) {
-    // 変数にオフセットを割り当てる
+// 変数にオフセットを割り当てる
+void assign_lvar_offsets(Function *prog) {
     for (Function *fn = prog; fn != NULL; fn = fn->next) {
         int o = 0;
         for (LVar *var = fn->locals; var != NULL; var = var->next) {
@@ -209,28 +400,82 @@ void gencode(Function *prog) {
         }
         fn->stack_size = o;
     }
+}
 
-    printf(".intel_syntax noprefix\n");
-    for (Function *fn = prog; fn != NULL; fn = fn->next) {
-        printf(".global %s\n", fn->name);
-        printf("%s:\n", fn->name);
-        funcname = fn->name;
-
-        // プロローグを出力する
-        printf("  push rbp\n");
-        printf("  mov rbp, rsp\n");
-        printf("  sub rsp, %d\n", fn->stack_size);
-
-        int l = 1;
-        for (Node *cur = fn->nodes; cur != NULL; cur = cur->next) {
-            printf("  # %s:%d function:%s, line:%d\n", __FILE__, __LINE__, fn->name, l++);
-            gen(cur);
+// 関数を1つ出力する。ラベルは関数名で区別するため、番号は関数ごとに振り直す
+static void gen_function(Function *fn, int idx) {
+    emit_function(fn->name);
+    emit_loc(fn->tok);
+    funcname = fn->name;
+    labelnumber = 0;
+
+    // フレームの大きさ。fn->stack_sizeはローカル変数の分だけを表すので書き換えない
+    int frame_size = fn->stack_size;
+
+    // サイクル数を計測するときは関数に入った時刻を置く場所をスタックに確保する
+    if (opt_instrument_cycles) {
+        frame_size += 8;
+    }
+    int time_offset = frame_size;
+
+    // 変数に割り当てた呼び出し先保存レジスタの退避場所を確保する
+    Reg saved_regs[MAX_REG_VARS];
+    int nsaved = 0;
+    if (profile_loaded) {
+        nsaved = pgo_assign_registers(fn, saved_regs);
+    }
+    int saved_offset = frame_size;
+    frame_size += nsaved * 8;
+
+    // プロローグを出力する
+    emit_push(RBP);
+    emit_mov(RBP, RSP);
+    emit_op_imm(OP_SUB, RSP, frame_size);
+    for (int i = 0; i < nsaved; i++) {
+        emit_store_local(saved_offset + (i + 1) * 8, saved_regs[i]);
+    }
+    if (opt_instrument) {
+        instrument_prologue(idx, time_offset);
+    }
+
+    int l = 1;
+    for (Node *cur = fn->nodes; cur != NULL; cur = cur->next) {
+        emit_comment("%s:%d function:%s, line:%d", __FILE__, __LINE__, fn->name, l++);
+        gen(cur);
+    }
+
+    // エピローグ
+    emit_label(".L.return.%s", funcname);
+    if (opt_instrument) {
+        instrument_epilogue(idx, time_offset);
+    }
+    for (int i = 0; i < nsaved; i++) {
+        emit_load_local(saved_regs[i], saved_offset + (i + 1) * 8);
+    }
+    emit_mov(RSP, RBP);
+    emit_pop(RBP);
+    emit_ret();
+    gen_cold_blocks();
+}
+
+// コード生成器のエントリポイント
+void gencode(Function *prog) {
+    assign_lvar_offsets(prog);
+
+    emit_begin();
+    int idx = 0;
+    for (Function *fn = prog; fn != NULL; fn = fn->next, idx++) {
+        // コンパイルサーバでは、変更のない関数の出力をキャッシュから再利用する
+        if (cache_lookup(fn)) {
+            continue;
         }
+        cache_begin();
+        gen_function(fn, idx);
+        cache_end();
+    }
 
-        // エピローグ
-        printf(".L.return.%s:\n", funcname);
-        printf("  mov rsp, rbp\n");
-        printf("  pop rbp\n");
-        printf("  ret\n");
+    if (opt_instrument) {
+        instrument_runtime(prog);
     }
+    emit_end();
 }
@@ -0,0 +1,141 @@
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
+#include "9cc.h"
+
+// 計測する分岐やループ
+typedef struct Branch Branch;
+struct Branch {
+    Branch *next;
+    int id;
+    char *kind;  // "if", "while", "for"
+    Token *tok;
+};
+
+static Branch *branches;
+static int nbranches;
+
+// 関数の入口でカウンタを増やす。サイクル数を計測するときは時刻を
+// RBPからoffsetの位置に保存する
+void instrument_prologue(int idx, int offset) {
+    emit_raw("inc qword ptr [rip + .L.prof.func.%d]", idx);
+    if (!opt_instrument_cycles) {
+        return;
+    }
+    emit_raw("rdtsc");
+    emit_raw("shl rdx, 32");
+    emit_raw("or rax, rdx");
+    emit_raw("mov [rbp-%d], rax", offset);
+}
+
+// サイクル数を計測するときは、関数の出口で経過サイクル数を積算する。戻り値のraxは保つ
+void instrument_epilogue(int idx, int offset) {
+    if (!opt_instrument_cycles) {
+        return;
+    }
+    emit_raw("mov r11, rax");
+    emit_raw("rdtsc");
+    emit_raw("shl rdx, 32");
+    emit_raw("or rax, rdx");
+    emit_raw("sub rax, [rbp-%d]", offset);
+    emit_raw("add [rip + .L.prof.func.%d + 8], rax", idx);
+    emit_raw("mov rax, r11");
+}
+
+// 分岐やループに2つのカウンタを割り当て、その番号を返す
+int instrument_branch(char *kind, Node *node) {
+    Branch *br = calloc(1, sizeof(Branch));
+    br->id = nbranches++;
+    br->kind = kind;
+    br->tok = node->tok;
+    br->next = branches;
+    branches = br;
+    return br->id;
+}
+
+// 分岐やループのwhich番目(0または1)のカウンタを増やす
+void instrument_count(int id, int which) {
+    emit_raw("inc qword ptr [rip + .L.prof.branch.%d + %d]", id, which * 8);
+}
+
+// カウンタの領域と、終了時にプロファイルを書き出す関数を出力する。
+// プロファイルは環境変数NINECC_PROFILEのファイル(既定は9cc.prof)に追記する。
+// 関数の行は "func 名前 行:桁 呼び出し回数 サイクル数" (サイクル数は呼び出し先の分も含み、
+// -finstrument=cyclesでなければ0)、
+// ifの行は "branch if 行:桁 実行回数 thenの実行回数"、
+// ループの行は "branch while(for) 行:桁 開始回数 反復回数" である。
+void instrument_runtime(Function *prog) {
+    emit_raw(".data");
+    emit_raw(".align 8");
+    int idx = 0;
+    for (Function *fn = prog; fn != NULL; fn = fn->next, idx++) {
+        emit_raw(".L.prof.func.%d: .quad 0, 0", idx);
+    }
+    for (Branch *br = branches; br != NULL; br = br->next) {
+        emit_raw(".L.prof.branch.%d: .quad 0, 0", br->id);
+    }
+
+    emit_raw(".section .rodata");
+    emit_raw(".L.prof.env: .string \"NINECC_PROFILE\"");
+    emit_raw(".L.prof.path: .string \"9cc.prof\"");
+    emit_raw(".L.prof.mode: .string \"a\"");
+    emit_raw(".L.prof.fmt: .string \"%%s %%ld %%ld\\n\"");
+    idx = 0;
+    for (Function *fn = prog; fn != NULL; fn = fn->next, idx++) {
+        emit_raw(".L.prof.func.name.%d: .string \"func %s %d:%d\"", idx, fn->name, fn->tok->line, fn->tok->col);
+    }
+    for (Branch *br = branches; br != NULL; br = br->next) {
+        emit_raw(".L.prof.branch.name.%d: .string \"branch %s %d:%d\"", br->id, br->kind, br->tok->line, br->tok->col);
+    }
+
+    // 他のオブジェクトファイルと衝突しないよう、ダンプ関数は大域的にしない
+    emit_raw(".text");
+    emit_label("__9cc_prof_dump");
+    emit_push(RBP);
+    emit_mov(RBP, RSP);
+    emit_push(RBX);
+    emit_op_imm(OP_SUB, RSP, 8);
+    emit_raw("lea rdi, [rip + .L.prof.env]");
+    emit_call("getenv");
+    emit_op_imm(OP_CMP, RAX, 0);
+    emit_jcc(CC_NE, ".L.prof.open");
+    emit_raw("lea rax, [rip + .L.prof.path]");
+    emit_label(".L.prof.open");
+    emit_mov(RDI, RAX);
+    emit_raw("lea rsi, [rip + .L.prof.mode]");
+    emit_call("fopen");
+    emit_op_imm(OP_CMP, RAX, 0);
+    emit_jcc(CC_E, ".L.prof.end");
+    emit_mov(RBX, RAX);
+
+    idx = 0;
+    for (Function *fn = prog; fn != NULL; fn = fn->next, idx++) {
+        emit_mov(RDI, RBX);
+        emit_raw("lea rsi, [rip + .L.prof.fmt]");
+        emit_raw("lea rdx, [rip + .L.prof.func.name.%d]", idx);
+        emit_raw("mov rcx, [rip + .L.prof.func.%d]", idx);
+        emit_raw("mov r8, [rip + .L.prof.func.%d + 8]", idx);
+        emit_mov_imm(RAX, 0);
+        emit_call("fprintf");
+    }
+    for (Branch *br = branches; br != NULL; br = br->next) {
+        emit_mov(RDI, RBX);
+        emit_raw("lea rsi, [rip + .L.prof.fmt]");
+        emit_raw("lea rdx, [rip + .L.prof.branch.name.%d]", br->id);
+        emit_raw("mov rcx, [rip + .L.prof.branch.%d]", br->id);
+        emit_raw("mov r8, [rip + .L.prof.branch.%d + 8]", br->id);
+        emit_mov_imm(RAX, 0);
+        emit_call("fprintf");
+    }
+
+    emit_mov(RDI, RBX);
+    emit_call("fclose");
+    emit_label(".L.prof.end");
+    emit_op_imm(OP_ADD, RSP, 8);
+    emit_pop(RBX);
+    emit_pop(RBP);
+    emit_ret();
+
+    // exit(3)の際に呼ばれるように登録する
+    emit_raw(".section .fini_array,\"aw\"");
+    emit_raw(".align 8");
+    emit_raw(".quad __9cc_prof_dump");
+}
@@ -0,0 +1,505 @@
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
+#define _GNU_SOURCE
+#include "9cc.h"
+#include <dlfcn.h>
+
+// レジスタ型バイトコードの命令の種別
+typedef enum {
+    BC_IMM,   // r[a] = b
+    BC_MOV,   // r[a] = r[b]
+    BC_ADD,   // r[a] = r[b] + r[c]
+    BC_SUB,   // r[a] = r[b] - r[c]
+    BC_MUL,   // r[a] = r[b] * r[c]
+    BC_DIV,   // r[a] = r[b] / r[c]
+    BC_EQ,    // r[a] = r[b] == r[c]
+    BC_NE,    // r[a] = r[b] != r[c]
+    BC_LT,    // r[a] = r[b] < r[c]
+    BC_LE,    // r[a] = r[b] <= r[c]
+    BC_JMP,   // 命令aへ飛ぶ
+    BC_JZ,    // r[a]が0ならば命令bへ飛ぶ
+    BC_CALL,  // r[a] = 関数b(r[c], ..., r[c+d-1])
+    BC_CALLX, // r[a] = 外部の関数b(r[c], ..., r[c+d-1])
+    BC_RET,   // r[a]を返す
+} Opcode;
+
+typedef struct Insn Insn;
+struct Insn {
+    void *handler; // 計算型gotoの飛び先。実行の直前に埋める
+    Opcode op;
+    int a;
+    int b;
+    int c;
+    int d;
+};
+
+// バイトコードに変換した関数
+typedef struct BcFunction BcFunction;
+struct BcFunction {
+    Function *fn;
+    int entry;      // 最初の命令の番号
+    int nregs;      // フレームに必要なレジスタの数
+};
+
+// 外部の関数の表
+typedef long (*ForeignFn)(long, long, long, long, long, long);
+
+typedef struct Foreign Foreign;
+struct Foreign {
+    char *name;
+    ForeignFn fn;
+};
+
+// 値のスタックと呼び出しのスタックの大きさ
+#define REG_STACK_SIZE (1 << 21)
+#define CALL_STACK_SIZE (1 << 16)
+
+typedef struct CallFrame CallFrame;
+struct CallFrame {
+    Insn *ret;    // 戻り先の命令
+    long *regs;   // 呼び出し元のレジスタ
+    int func;     // 呼び出し元の関数
+    int dst;      // 戻り値を入れる呼び出し元のレジスタ
+};
+
+static Insn *insns;
+static int ninsns;
+static int insn_cap;
+
+static BcFunction *funcs;
+static int nfuncs;
+
+static Foreign *foreigns;
+static int nforeigns;
+
+// コンパイル中の関数の情報
+static Function *cur_fn;
+static int ntemps;     // 使用中の一時レジスタの数
+static int max_regs;
+
+static int emit(Opcode op, int a, int b, int c, int d) {
+    if (ninsns == insn_cap) {
+        insn_cap = insn_cap == 0 ? 256 : insn_cap * 2;
+        insns = realloc(insns, sizeof(Insn) * insn_cap);
+    }
+    Insn *insn = &insns[ninsns];
+    insn->handler = NULL;
+    insn->op = op;
+    insn->a = a;
+    insn->b = b;
+    insn->c = c;
+    insn->d = d;
+    return ninsns++;
+}
+
+// ローカル変数に割り当てたレジスタの番号。gencodeと同じくオフセットから求める
+static int var_reg(LVar *var) {
+    return var->offset / 8 - 1;
+}
+
+// 一時レジスタを確保する。一時レジスタはローカル変数の後ろにスタック状に確保する
+static int alloc_temp(void) {
+    int r = cur_fn->stack_size / 8 + ntemps++;
+    if (r + 1 > max_regs) {
+        max_regs = r + 1;
+    }
+    return r;
+}
+
+static void free_temp(void) {
+    ntemps--;
+}
+
+static int find_func(char *name) {
+    for (int i = 0; i < nfuncs; i++) {
+        if (strcmp(funcs[i].fn->name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// 外部の関数を表に登録し、その番号を返す
+static int find_foreign(char *name) {
+    for (int i = 0; i < nforeigns; i++) {
+        if (strcmp(foreigns[i].name, name) == 0) {
+            return i;
+        }
+    }
+
+    void *addr = dlsym(RTLD_DEFAULT, name);
+    if (addr == NULL) {
+        error("関数が見つかりません: %s", name);
+    }
+    foreigns = realloc(foreigns, sizeof(Foreign) * (nforeigns + 1));
+    foreigns[nforeigns].name = name;
+    foreigns[nforeigns].fn = (ForeignFn)addr;
+    return nforeigns++;
+}
+
+static bool is_assign(Node *node, void *arg) {
+    return node->kind == ND_ASSIGN;
+}
+
+static bool has_assign(Node *node) {
+    return walk_nodes(node, false, is_assign, NULL);
+}
+
+// 式のバイトコード生成で、子の処理を待っているノード
+typedef struct CompileFrame CompileFrame;
+struct CompileFrame {
+    Node *node;
+    int dst;    // 結果を入れるレジスタ
+    int state;  // 処理の段階。子を1つ積むたびに進む
+    int l;      // 左辺の値を持つレジスタ(二項演算)
+    int r;      // 右辺の値を持つレジスタ(二項演算)
+    Node *arg;  // 次に計算する引数(ND_FUNCALL)
+    int base;   // 最初の引数を置いた一時レジスタ(ND_FUNCALL)
+    int nargs;  // 計算した引数の数(ND_FUNCALL)
+};
+
+// 式のバイトコード生成に使う明示的なスタック。入れ子の深さはヒープの大きさだけで制限される
+static CompileFrame *cframes;
+static int ncframes;
+static int cap_cframes;
+
+static void push_cframe(Node *node, int dst) {
+    if (ncframes == cap_cframes) {
+        cap_cframes = cap_cframes == 0 ? 64 : cap_cframes * 2;
+        cframes = realloc(cframes, sizeof(CompileFrame) * cap_cframes);
+    }
+    cframes[ncframes++] = (CompileFrame){node, dst, 0, 0, 0, node->args, -1, 0};
+}
+
+static void compile_expr(Node *node, int dst);
+
+// 式の値を持つレジスタを返す。ローカル変数ならばそのレジスタを直接使う。
+// そうでなければ一時レジスタtmpに計算する
+static int operand(Node *node, int tmp) {
+    if (node->kind == ND_LVAR) {
+        return var_reg(node->var);
+    }
+    compile_expr(node, tmp);
+    return tmp;
+}
+
+// 式を計算してレジスタdstに入れるコードを、再帰を使わずに出力する
+static void compile_expr(Node *node, int dst) {
+    static Opcode binops[] = {
+        [ND_ADD] = BC_ADD, [ND_SUB] = BC_SUB, [ND_MUL] = BC_MUL, [ND_DIV] = BC_DIV,
+        [ND_EQ] = BC_EQ, [ND_NE] = BC_NE, [ND_LT] = BC_LT, [ND_LE] = BC_LE,
+    };
+
+    int bottom = ncframes;
+    push_cframe(node, dst);
+
+    while (ncframes > bottom) {
+        CompileFrame *f = &cframes[ncframes - 1];
+        node = f->node;
+        int state = f->state++;
+
+        switch (node->kind) {
+            case ND_NUM:
+                emit(BC_IMM, f->dst, node->val, 0, 0);
+                ncframes--;
+                continue;
+            case ND_LVAR:
+                emit(BC_MOV, f->dst, var_reg(node->var), 0, 0);
+                ncframes--;
+                continue;
+            case ND_ASSIGN: {
+                if (node->lhs->kind != ND_LVAR) {
+                    error("代入の左辺値が変数ではありません");
+                }
+                int var = var_reg(node->lhs->var);
+                if (state == 0) {
+                    push_cframe(node->rhs, var);
+                    continue;
+                }
+                if (f->dst != var) {
+                    emit(BC_MOV, f->dst, var, 0, 0);
+                }
+                ncframes--;
+                continue;
+            }
+            case ND_FUNCALL:
+                // 引数は連続した一時レジスタに置く
+                if (f->arg != NULL) {
+                    Node *arg = f->arg;
+                    int r = alloc_temp();
+                    f->arg = arg->next;
+                    if (f->base < 0) {
+                        f->base = r;
+                    }
+                    f->nargs++;
+                    push_cframe(arg, r);
+                    continue;
+                }
+                if (f->nargs > 6) {
+                    error("引数が多すぎます: %s", node->funcname);
+                }
+                for (int i = 0; i < f->nargs; i++) {
+                    free_temp();
+                }
+
+                int fn = find_func(node->funcname);
+                if (fn >= 0) {
+                    emit(BC_CALL, f->dst, fn, f->base, f->nargs);
+                } else {
+                    emit(BC_CALLX, f->dst, find_foreign(node->funcname), f->base, f->nargs);
+                }
+                ncframes--;
+                continue;
+        }
+
+        // 二項演算。右辺がローカル変数に代入しなければ、左辺の変数は演算の時点でも同じ値を持つ
+        if (state == 0) {
+            f->l = alloc_temp();
+            if (node->lhs->kind == ND_LVAR && !has_assign(node->rhs)) {
+                f->l = var_reg(node->lhs->var);
+            } else {
+                push_cframe(node->lhs, f->l);
+            }
+            continue;
+        }
+        if (state == 1) {
+            f->r = alloc_temp();
+            if (node->rhs->kind == ND_LVAR) {
+                f->r = var_reg(node->rhs->var);
+            } else {
+                push_cframe(node->rhs, f->r);
+            }
+            continue;
+        }
+        free_temp();
+        free_temp();
+        emit(binops[node->kind], f->dst, f->l, f->r, 0);
+        ncframes--;
+    }
+}
+
+static void compile_stmt(Node *node) {
+    int t, j, j2, top;
+
+    switch (node->kind) {
+        case ND_RETURN:
+            t = alloc_temp();
+            emit(BC_RET, operand(node->lhs, t), 0, 0, 0);
+            free_temp();
+            return;
+        case ND_EXPR_STMT:
+            // 代入文は変数のレジスタに直接計算し、それ以外の値は一時レジスタに捨てる
+            t = alloc_temp();
+            if (node->lhs->kind == ND_ASSIGN && node->lhs->lhs->kind == ND_LVAR) {
+                compile_expr(node->lhs, var_reg(node->lhs->lhs->var));
+            } else {
+                compile_expr(node->lhs, t);
+            }
+            free_temp();
+            return;
+        case ND_IF:
+            t = alloc_temp();
+            j = emit(BC_JZ, operand(node->cond, t), 0, 0, 0);
+            free_temp();
+            compile_stmt(node->then);
+            if (node->els == NULL) {
+                insns[j].b = ninsns;
+                return;
+            }
+            j2 = emit(BC_JMP, 0, 0, 0, 0);
+            insns[j].b = ninsns;
+            compile_stmt(node->els);
+            insns[j2].a = ninsns;
+            return;
+        case ND_WHILE:
+            top = ninsns;
+            t = alloc_temp();
+            j = emit(BC_JZ, operand(node->cond, t), 0, 0, 0);
+            free_temp();
+            compile_stmt(node->body);
+            emit(BC_JMP, top, 0, 0, 0);
+            insns[j].b = ninsns;
+            return;
+        case ND_FOR:
+            if (node->init != NULL) {
+                compile_stmt(node->init);
+            }
+            top = ninsns;
+            j = -1;
+            if (node->cond != NULL) {
+                t = alloc_temp();
+                j = emit(BC_JZ, operand(node->cond, t), 0, 0, 0);
+                free_temp();
+            }
+            compile_stmt(node->body);
+            if (node->inc != NULL) {
+                compile_stmt(node->inc);
+            }
+            emit(BC_JMP, top, 0, 0, 0);
+            if (j >= 0) {
+                insns[j].b = ninsns;
+            }
+            return;
+        case ND_BLOCK:
+            for (Node *n = node->block; n != NULL; n = n->next) {
+                compile_stmt(n);
+            }
+            return;
+    }
+    error("バイトコードに変換できない文です");
+}
+
+// 関数をバイトコードに変換する
+static void compile_function(BcFunction *bf) {
+    cur_fn = bf->fn;
+    ntemps = 0;
+    max_regs = cur_fn->stack_size / 8;
+    bf->entry = ninsns;
+
+    for (Node *n = cur_fn->nodes; n != NULL; n = n->next) {
+        compile_stmt(n);
+    }
+
+    // returnせずに末尾に到達した場合は0を返す
+    int t = alloc_temp();
+    emit(BC_IMM, t, 0, 0, 0);
+    emit(BC_RET, t, 0, 0, 0);
+    bf->nregs = max_regs;
+}
+
+// バイトコードを実行し、関数fの戻り値を返す
+static long run(int f) {
+    static void *handlers[] = {
+        [BC_IMM] = &&op_imm, [BC_MOV] = &&op_mov,
+        [BC_ADD] = &&op_add, [BC_SUB] = &&op_sub, [BC_MUL] = &&op_mul, [BC_DIV] = &&op_div,
+        [BC_EQ] = &&op_eq, [BC_NE] = &&op_ne, [BC_LT] = &&op_lt, [BC_LE] = &&op_le,
+        [BC_JMP] = &&op_jmp, [BC_JZ] = &&op_jz,
+        [BC_CALL] = &&op_call, [BC_CALLX] = &&op_callx, [BC_RET] = &&op_ret,
+    };
+
+    // 命令ごとに処理の飛び先を埋めておく
+    for (int i = 0; i < ninsns; i++) {
+        insns[i].handler = handlers[insns[i].op];
+    }
+
+    long *stack = calloc(REG_STACK_SIZE, sizeof(long));
+    long *stack_end = stack + REG_STACK_SIZE;
+    CallFrame *calls = calloc(CALL_STACK_SIZE, sizeof(CallFrame));
+    int depth = 0;
+
+    long *r = stack;
+    long result = 0;
+    Insn *pc = &insns[funcs[f].entry];
+    BcFunction *callee;
+    Foreign *ff;
+
+#define DISPATCH() goto *pc->handler
+#define NEXT() do { pc++; DISPATCH(); } while (0)
+
+    DISPATCH();
+
+op_imm:
+    r[pc->a] = pc->b;
+    NEXT();
+op_mov:
+    r[pc->a] = r[pc->b];
+    NEXT();
+op_add:
+    r[pc->a] = (long)((unsigned long)r[pc->b] + (unsigned long)r[pc->c]);
+    NEXT();
+op_sub:
+    r[pc->a] = (long)((unsigned long)r[pc->b] - (unsigned long)r[pc->c]);
+    NEXT();
+op_mul:
+    r[pc->a] = (long)((unsigned long)r[pc->b] * (unsigned long)r[pc->c]);
+    NEXT();
+op_div:
+    if (r[pc->c] == 0 || (r[pc->b] == LONG_MIN && r[pc->c] == -1)) {
+        error("ゼロ除算です");
+    }
+    r[pc->a] = r[pc->b] / r[pc->c];
+    NEXT();
+op_eq:
+    r[pc->a] = r[pc->b] == r[pc->c];
+    NEXT();
+op_ne:
+    r[pc->a] = r[pc->b] != r[pc->c];
+    NEXT();
+op_lt:
+    r[pc->a] = r[pc->b] < r[pc->c];
+    NEXT();
+op_le:
+    r[pc->a] = r[pc->b] <= r[pc->c];
+    NEXT();
+op_jmp:
+    pc = &insns[pc->a];
+    DISPATCH();
+op_jz:
+    if (r[pc->a] == 0) {
+        pc = &insns[pc->b];
+        DISPATCH();
+    }
+    NEXT();
+op_call:
+    // 呼び出し先のフレームは呼び出し元のレジスタの直後に置く
+    callee = &funcs[pc->b];
+    if (depth == CALL_STACK_SIZE || r + funcs[f].nregs + callee->nregs > stack_end) {
+        error("スタックが溢れました");
+    }
+    calls[depth].ret = pc + 1;
+    calls[depth].regs = r;
+    calls[depth].func = f;
+    calls[depth].dst = pc->a;
+    depth++;
+    r += funcs[f].nregs;
+    f = pc->b;
+    pc = &insns[callee->entry];
+    DISPATCH();
+op_callx: {
+    long args[6] = {};
+    for (int i = 0; i < pc->d; i++) {
+        args[i] = r[pc->c + i];
+    }
+    ff = &foreigns[pc->b];
+    r[pc->a] = ff->fn(args[0], args[1], args[2], args[3], args[4], args[5]);
+    NEXT();
+}
+op_ret:
+    result = r[pc->a];
+    if (depth == 0) {
+        free(stack);
+        free(calls);
+        return result;
+    }
+    depth--;
+    r = calls[depth].regs;
+    r[calls[depth].dst] = result;
+    f = calls[depth].func;
+    pc = calls[depth].ret;
+    DISPATCH();
+
+#undef NEXT
+#undef DISPATCH
+}
+
+// プログラムをバイトコードに変換して実行し、mainの戻り値を返す
+int interpret(Function *prog) {
+    assign_lvar_offsets(prog);
+
+    for (Function *fn = prog; fn != NULL; fn = fn->next) {
+        nfuncs++;
+    }
+    funcs = calloc(nfuncs, sizeof(BcFunction));
+    int i = 0;
+    for (Function *fn = prog; fn != NULL; fn = fn->next) {
+        funcs[i++].fn = fn;
+    }
+    for (i = 0; i < nfuncs; i++) {
+        compile_function(&funcs[i]);
+    }
+
+    int m = find_func("main");
+    if (m < 0) {
+        error("mainが定義されていません");
+    }
+    return run(m);
+}
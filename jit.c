@@ -0,0 +1,133 @@
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
+#define _GNU_SOURCE
+#include "9cc.h"
+#include <dlfcn.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// 外部の関数へ飛ぶトランポリン: jmp [rip+0] の後に飛び先の絶対アドレスを置く
+#define TRAMPOLINE_SIZE 14
+
+typedef struct Trampoline Trampoline;
+struct Trampoline {
+    Trampoline *next;
+    char *name;
+    int offset;
+};
+
+// 外部の関数を探すために共有ライブラリを読み込む
+void jit_load_library(char *path) {
+    if (dlopen(path, RTLD_NOW | RTLD_GLOBAL) == NULL) {
+        error("共有ライブラリを読み込めません: %s", dlerror());
+    }
+}
+
+static void patch32(unsigned char *p, int v) {
+    for (int i = 0; i < 4; i++) {
+        p[i] = (v >> (i * 8)) & 0xff;
+    }
+}
+
+// perfが実行時に生成したコードの関数名を解決できるよう、/tmp/perf-<pid>.mapに
+// "先頭アドレス 大きさ 名前" の形で関数とトランポリンの位置を書き出す。
+// perfはいつ起動されるか分からないので、-gの有無によらず実行のたびに書き出す。
+// デバッグの補助にすぎないので、書き出せなくても警告するだけで実行は続ける。
+// 書き出す先のディレクトリは環境変数NINECC_PERF_MAP_DIRで変えられる(perfが読むのは/tmpだけである)
+static void write_perf_map(unsigned char *mem, Code *code, Trampoline *tramps) {
+    char *dir = getenv("NINECC_PERF_MAP_DIR");
+    if (dir == NULL) {
+        dir = "/tmp";
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/perf-%d.map", dir, getpid());
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "警告: %sを開けません: %s\n", path, strerror(errno));
+        return;
+    }
+    for (Symbol *sym = code->symbols; sym != NULL; sym = sym->next) {
+        fprintf(fp, "%lx %x %s\n", (unsigned long)(mem + sym->offset), symbol_size(code, sym), sym->name);
+    }
+    for (Trampoline *t = tramps; t != NULL; t = t->next) {
+        fprintf(fp, "%lx %x [trampoline] %s\n", (unsigned long)(mem + t->offset), TRAMPOLINE_SIZE, t->name);
+    }
+    bool failed = ferror(fp);
+    if (fclose(fp) != 0 || failed) {
+        fprintf(stderr, "警告: %sに書き出せません\n", path);
+    }
+}
+
+// 機械語を実行可能なメモリに配置し、mainを呼び出してその戻り値を返す
+int jit_run(Code *code) {
+    // 外部の関数ごとにトランポリンを1つ用意する。
+    // 呼び出し先がrel32の届く範囲にあるとは限らないため。
+    Trampoline *tramps = NULL;
+    int size = code->len;
+    for (Reloc *rel = code->relocs; rel != NULL; rel = rel->next) {
+        if (find_symbol(code, rel->name) != NULL) {
+            continue;
+        }
+        bool found = false;
+        for (Trampoline *t = tramps; t != NULL; t = t->next) {
+            if (strcmp(t->name, rel->name) == 0) {
+                found = true;
+                break;
+            }
+        }
+        if (found) {
+            continue;
+        }
+        Trampoline *t = calloc(1, sizeof(Trampoline));
+        t->name = rel->name;
+        t->offset = size;
+        t->next = tramps;
+        tramps = t;
+        size += TRAMPOLINE_SIZE;
+    }
+
+    unsigned char *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        error("メモリを確保できません: %s", strerror(errno));
+    }
+    memcpy(mem, code->data, code->len);
+
+    for (Trampoline *t = tramps; t != NULL; t = t->next) {
+        void *addr = dlsym(RTLD_DEFAULT, t->name);
+        if (addr == NULL) {
+            error("関数が見つかりません: %s", t->name);
+        }
+        unsigned char *p = mem + t->offset;
+        p[0] = 0xff;
+        p[1] = 0x25;
+        patch32(p + 2, 0);
+        memcpy(p + 6, &addr, sizeof(addr));
+    }
+
+    // 呼び出し先を解決する
+    for (Reloc *rel = code->relocs; rel != NULL; rel = rel->next) {
+        int target;
+        Symbol *sym = find_symbol(code, rel->name);
+        if (sym != NULL) {
+            target = sym->offset;
+        } else {
+            Trampoline *t = tramps;
+            while (strcmp(t->name, rel->name) != 0) {
+                t = t->next;
+            }
+            target = t->offset;
+        }
+        patch32(mem + rel->offset, target - (rel->offset + 4));
+    }
+
+    if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0) {
+        error("メモリを実行可能にできません: %s", strerror(errno));
+    }
+    write_perf_map(mem, code, tramps);
+
+    Symbol *main_sym = find_symbol(code, "main");
+    if (main_sym == NULL) {
+        error("mainが定義されていません");
+    }
+    int (*entry)(void) = (int (*)(void))(mem + main_sym->offset);
+    return entry();
+}
@@ -1,17 +1,240 @@
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
 #include "9cc.h"
 
-int main(int argc, char **argv) {
-    if (argc != 2) {
+// ループ展開の倍率。0ならばループ展開を行なわない
+int opt_unroll_factor = 0;
+
+// 純粋な関数の呼び出しをコンパイル時に評価するか
+bool opt_fold_pure_calls = false;
+
+// 生成した機械語をその場で実行するか
+bool opt_run = false;
+
+// アセンブリではなくオブジェクトファイルを出力するか
+bool opt_object = false;
+
+// バイトコードに変換してインタプリタで実行するか
+bool opt_interp = false;
+
+// フェーズごとの時間とメモリを報告するか
+bool opt_time_report = false;
+bool opt_time_report_json = false;
+
+// 生成コードに関数ごとの呼び出し回数の計測を埋め込むか
+bool opt_instrument = false;
+// 分岐やループの実行回数も計測するか
+bool opt_instrument_branches = false;
+// 関数ごとのサイクル数も計測するか。rdtscを呼び出しごとに2回実行するので重い
+bool opt_instrument_cycles = false;
+
+// 最適化に使うプロファイルのファイル名。NULLならば使わない
+char *opt_profile_use = NULL;
+
+// 入力中の位置と命令を対応づけるデバッグ情報を出力するか
+bool opt_debug_info = false;
+
+// 既定のループ展開の倍率
+#define DEFAULT_UNROLL_FACTOR 4
+
+// -funroll-loops=Nで指定できる倍率の上限
+#define MAX_UNROLL_FACTOR 64
+
+// プログラムをコンパイルし、出力または実行する。終了ステータスを返す
+static int compile(Function *prog) {
+    if (opt_fold_pure_calls) {
+        phase_begin("fold");
+        fold_pure_calls(prog);
+        phase_end(prog);
+    }
+    if (opt_unroll_factor > 0) {
+        phase_begin("unroll");
+        unroll_loops(prog);
+        phase_end(prog);
+    }
+    if (opt_profile_use != NULL) {
+        phase_begin("pgo");
+        load_profile(opt_profile_use);
+        pgo_inline(prog);
+        phase_end(prog);
+    }
+
+    if (opt_interp) {
+        phase_begin("interp");
+        int status = interpret(prog);
+        phase_end(NULL);
+        return status;
+    }
+
+    if (opt_run || opt_object) {
+        emit_machine_code = true;
+        phase_begin("codegen");
+        gencode(prog);
+        phase_end(NULL);
+
+        if (opt_run) {
+            phase_begin("run");
+            int status = jit_run(code);
+            phase_end(NULL);
+            return status;
+        }
+
+        phase_begin("output");
+        write_elf(code, stdout);
+        fflush(stdout);
+        phase_end(NULL);
+        return 0;
+    }
+
+    // 計測するときはコード生成と書き出しを分けるため、一旦メモリ上に出力する
+    if (!opt_time_report) {
+        output = stdout;
+        gencode(prog);
+        return 0;
+    }
+
+    char *buf;
+    size_t len;
+    output = open_memstream(&buf, &len);
+    phase_begin("codegen");
+    gencode(prog);
+    fflush(output);
+    phase_end(NULL);
+
+    phase_begin("output");
+    fwrite(buf, 1, len, stdout);
+    fflush(stdout);
+    phase_end(NULL);
+    fclose(output);
+    free(buf);
+    return 0;
+}
+
+// 引数を解釈してコンパイルし、終了ステータスを返す
+int compiler_main(int argc, char **argv) {
+    char *input = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        char *arg = argv[i];
+
+        if (strcmp(arg, "-ffold-pure-calls") == 0) {
+            opt_fold_pure_calls = true;
+            continue;
+        }
+        if (strcmp(arg, "-funroll-loops") == 0) {
+            opt_unroll_factor = DEFAULT_UNROLL_FACTOR;
+            continue;
+        }
+        if (startswith("-funroll-loops=", arg)) {
+            char *val = arg + strlen("-funroll-loops=");
+            char *end;
+            errno = 0;
+            long factor = strtol(val, &end, 10);
+            if (end == val || *end != '\0' || errno != 0 || factor < 1 || MAX_UNROLL_FACTOR < factor) {
+                error("ループ展開の倍率が正しくありません(1から%dまで): %s", MAX_UNROLL_FACTOR, arg);
+            }
+            opt_unroll_factor = factor;
+            continue;
+        }
+        if (strcmp(arg, "-ftime-report") == 0) {
+            opt_time_report = true;
+            continue;
+        }
+        if (strcmp(arg, "-ftime-report=json") == 0) {
+            opt_time_report = true;
+            opt_time_report_json = true;
+            continue;
+        }
+        if (strcmp(arg, "-finstrument") == 0) {
+            opt_instrument = true;
+            continue;
+        }
+        if (strcmp(arg, "-finstrument=branches") == 0) {
+            opt_instrument = true;
+            opt_instrument_branches = true;
+            continue;
+        }
+        if (strcmp(arg, "-finstrument=cycles") == 0) {
+            opt_instrument = true;
+            opt_instrument_cycles = true;
+            continue;
+        }
+        if (startswith("-fprofile-use=", arg)) {
+            opt_profile_use = arg + strlen("-fprofile-use=");
+            continue;
+        }
+        if (strcmp(arg, "-g") == 0) {
+            opt_debug_info = true;
+            continue;
+        }
+        if (strcmp(arg, "--run") == 0) {
+            opt_run = true;
+            continue;
+        }
+        if (strcmp(arg, "--interp") == 0) {
+            opt_interp = true;
+            continue;
+        }
+        if (strcmp(arg, "-c") == 0) {
+            opt_object = true;
+            continue;
+        }
+        if (strcmp(arg, "-o") == 0) {
+            if (++i == argc) {
+                error("-oの後に出力ファイル名がありません");
+            }
+            if (freopen(argv[i], "w", stdout) == NULL) {
+                error("%sを開けません: %s", argv[i], strerror(errno));
+            }
+            continue;
+        }
+        if (startswith("--load=", arg)) {
+            jit_load_library(arg + strlen("--load="));
+            continue;
+        }
+        if (arg[0] == '-') {
+            error("不明なオプションです: %s", arg);
+        }
+
+        if (input != NULL) {
+            fprintf(stderr, "引数の個数が正しくありません\n");
+            return 1;
+        }
+        input = arg;
+    }
+
+    if (input == NULL) {
         fprintf(stderr, "引数の個数が正しくありません\n");
         return 1;
     }
+    if (opt_instrument && (opt_run || opt_object || opt_interp)) {
+        error("-finstrumentはアセンブリを出力するときにしか使えません");
+    }
 
     setlocale(LC_CTYPE, "C");  // isalnum(3)に正しく判定させる
-    user_input = argv[1];
+    user_input = input;
+
+    phase_begin("lex");
     token = tokenize(user_input);
+    phase_end(NULL);
+    Token *tokens = token;
+
+    phase_begin("parse");
     Function *prog = program();
-    gencode(prog);
+    phase_end(prog);
+
+    int status = compile(prog);
+    print_time_report(tokens, prog);
 
-   return 0;
+   return status;
+}
+
+int main(int argc, char **argv) {
+    if (argc >= 2 && startswith("--server=", argv[1])) {
+        run_server(argv[1] + strlen("--server="));
+        return 0;
+    }
+    if (argc >= 2 && startswith("--client=", argv[1])) {
+        return run_client(argv[1] + strlen("--client="), argc - 2, argv + 2);
+    }
+    return compiler_main(argc, argv);
 }
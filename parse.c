@@ -10,13 +10,14 @@ char *user_input;
 // ローカル変数
 LVar *locals = NULL;
 
+// 字句解析中の行番号とその行の先頭
+static int line;
+static char *line_start;
+
 static void error_at(char *loc, char *fmt, ...);
 static Token *new_token(TokenKind kind, Token *cur, char *str, int len);
 static char *starts_with_reserved(char *p);
 
-static Node *new_node(NodeKind kind);
-static Node *new_node_binary(NodeKind kind, Node *lhs, Node *rhs);
-static Node *new_node_num(int val);
 static Node *new_node_lvar(LVar *var);
 static Node *new_node_if(Node *cond, Node *then, Node *els);
 static Node *new_node_while(Node *cond, Node *body);
@@ -38,14 +39,6 @@ static Function *new_function(char *name, Node *nodes, LVar *locals);
 static Function *function(void);
 static Node *stmt(void);
 static Node *expr(void);
-static Node *assign(void);
-static Node *equality(void);
-static Node *relational(void);
-static Node *add(void);
-static Node *mul(void);
-static Node *unary(void);
-static Node *primary(void);
-static Node *func_args(void);
 
 // プログラム中のどこにエラーがあるか報告する
 static void error_at(char *loc, char *fmt, ...) {
@@ -128,6 +121,8 @@ static Token *new_token(TokenKind kind, Token *cur, char *str, int len) {
     tok->kind = kind;
     tok->str = str;
     tok->len = len;
+    tok->line = line;
+    tok->col = str - line_start + 1;
     cur->next = tok;
     return tok;
 }
@@ -167,10 +162,16 @@ Token *tokenize(char *p) {
     Token head;
     head.next = NULL;
     Token *cur = &head;
+    line = 1;
+    line_start = p;
 
     while (*p) {
         // 空白文字は読み飛ばす
         if (isspace(*p)) {
+            if (*p == '\n') {
+                line++;
+                line_start = p + 1;
+            }
             p++;
             continue;
         }
@@ -214,13 +215,13 @@ Token *tokenize(char *p) {
     return head.next;
 }
 
-static Node *new_node(NodeKind kind) {
+Node *new_node(NodeKind kind) {
     Node *node = calloc(1, sizeof(Node));
     node->kind = kind;
     return node;
 }
 
-static Node *new_node_binary(NodeKind kind, Node *lhs, Node *rhs) {
+Node *new_node_binary(NodeKind kind, Node *lhs, Node *rhs) {
     Node *node = calloc(1, sizeof(Node));
     node->kind = kind;
     node->lhs = lhs;
@@ -228,13 +229,182 @@ static Node *new_node_binary(NodeKind kind, Node *lhs, Node *rhs) {
     return node;
 }
 
-static Node *new_node_num(int val) {
+Node *new_node_num(int val) {
     Node *node = calloc(1, sizeof(Node));
     node->kind = ND_NUM;
     node->val = val;
     return node;
 }
 
+// 木を辿るための明示的なスタックの要素
+typedef struct WalkFrame WalkFrame;
+struct WalkFrame {
+    Node *node;
+    Node *copy;     // nodeの複製(copy_node)
+    bool expanded;  // 子を積み終えたか(walk_nodesで帰りがけに訪れるとき)
+};
+
+// 木を辿るための明示的なスタック。入れ子の深さはヒープの大きさだけで制限される。
+// 辿っている途中で別の木を辿れるよう、各関数は自分が積んだ分だけを使う
+static WalkFrame *walk_stack;
+static int nwalk;
+static int cap_walk;
+
+static void push_walk(Node *node, Node *copy, bool expanded) {
+    if (nwalk == cap_walk) {
+        cap_walk = cap_walk == 0 ? 64 : cap_walk * 2;
+        walk_stack = realloc(walk_stack, sizeof(WalkFrame) * cap_walk);
+    }
+    walk_stack[nwalk++] = (WalkFrame){node, copy, expanded};
+}
+
+// start以降に積んだ要素の順序を逆にする。列を前から順に取り出せるようにする
+static void reverse_walk(int start) {
+    for (int i = start, j = nwalk - 1; i < j; i++, j--) {
+        WalkFrame f = walk_stack[i];
+        walk_stack[i] = walk_stack[j];
+        walk_stack[j] = f;
+    }
+}
+
+static void push_walk_child(Node *node) {
+    if (node != NULL) {
+        push_walk(node, NULL, false);
+    }
+}
+
+static void push_walk_list(Node *node) {
+    int start = nwalk;
+    for (Node *n = node; n != NULL; n = n->next) {
+        push_walk(n, NULL, false);
+    }
+    reverse_walk(start);
+}
+
+// 子をlhs, rhs, cond, then, els, body, init, inc, block, argsの順に取り出せるよう積む
+static void push_walk_children(Node *node) {
+    push_walk_list(node->args);
+    push_walk_list(node->block);
+    push_walk_child(node->inc);
+    push_walk_child(node->init);
+    push_walk_child(node->body);
+    push_walk_child(node->els);
+    push_walk_child(node->then);
+    push_walk_child(node->cond);
+    push_walk_child(node->rhs);
+    push_walk_child(node->lhs);
+}
+
+// nodeとその子孫を、再帰を使わずに辿ってvisitを呼ぶ。インライン展開した本体は辿らない。
+// postが偽ならば親を子より先に、真ならば子を親より先に訪れる。
+// visitが真を返したらそこで打ち切って真を返す
+bool walk_nodes(Node *node, bool post, bool (*visit)(Node *node, void *arg), void *arg) {
+    int base = nwalk;
+    push_walk_child(node);
+
+    while (nwalk > base) {
+        WalkFrame f = walk_stack[--nwalk];
+        if (!f.expanded && post) {
+            push_walk(f.node, NULL, true);
+            push_walk_children(f.node);
+            continue;
+        }
+        if (visit(f.node, arg)) {
+            nwalk = base;
+            return true;
+        }
+        if (!post) {
+            push_walk_children(f.node);
+        }
+    }
+    return false;
+}
+
+// nextとインライン展開した本体を除いて複製し、子の複製を待つものとして積む
+static Node *push_copy(Node *node) {
+    if (node == NULL) {
+        return NULL;
+    }
+    Node *n = calloc(1, sizeof(Node));
+    *n = *node;
+    n->next = NULL;
+    n->inlined = NULL;
+    push_walk(node, n, false);
+    return n;
+}
+
+static Node *push_copy_list(Node *node) {
+    Node head = {};
+    Node *cur = &head;
+    int start = nwalk;
+    for (Node *n = node; n != NULL; n = n->next) {
+        cur->next = push_copy(n);
+        cur = cur->next;
+    }
+    reverse_walk(start);
+    return head.next;
+}
+
+// ノードを子孫ごと、再帰を使わずに複製する。nextとインライン展開した本体は複製しない。
+// map_varがNULLでなければ、変数をmap_varの返すものに付け替える。map_varは行きがけ順に呼ばれる
+Node *copy_node(Node *node, LVar *(*map_var)(LVar *var)) {
+    int base = nwalk;
+    Node *root = push_copy(node);
+
+    while (nwalk > base) {
+        WalkFrame f = walk_stack[--nwalk];
+        Node *n = f.copy;
+        if (n->var != NULL && map_var != NULL) {
+            n->var = map_var(f.node->var);
+        }
+        // push_walk_childrenと同じく、後に取り出す子から積む
+        n->args = push_copy_list(f.node->args);
+        n->block = push_copy_list(f.node->block);
+        n->inc = push_copy(f.node->inc);
+        n->init = push_copy(f.node->init);
+        n->body = push_copy(f.node->body);
+        n->els = push_copy(f.node->els);
+        n->then = push_copy(f.node->then);
+        n->cond = push_copy(f.node->cond);
+        n->rhs = push_copy(f.node->rhs);
+        n->lhs = push_copy(f.node->lhs);
+    }
+    return root;
+}
+
+// nextで繋がったノードの列を複製する
+Node *copy_list(Node *node, LVar *(*map_var)(LVar *var)) {
+    Node head = {};
+    Node *cur = &head;
+    for (Node *n = node; n != NULL; n = n->next) {
+        cur->next = copy_node(n, map_var);
+        cur = cur->next;
+    }
+    return head.next;
+}
+
+static bool count_node(Node *node, void *arg) {
+    (*(int *)arg)++;
+    return false;
+}
+
+// ノードを子孫ごと数える
+int count_nodes(Node *node) {
+    int n = 0;
+    walk_nodes(node, false, count_node, &n);
+    return n;
+}
+
+// 名前で関数を探す。見つからなければNULLを返す
+Function *find_function(Function *prog, char *name) {
+    for (Function *fn = prog; fn != NULL; fn = fn->next) {
+        if (strcmp(fn->name, name) == 0) {
+            return fn;
+        }
+    }
+    return NULL;
+}
+
 static Node *new_node_lvar(LVar *var) {
     Node *node = calloc(1, sizeof(Node));
     node->kind = ND_LVAR;
@@ -329,6 +499,7 @@ static Function *function(void) {
     // 変数の新たな有効範囲を導入する。
     locals = NULL;
 
+    Token *tok = token;
     char *name = expect_ident();
     expect("(");
     expect(")");
@@ -343,7 +514,10 @@ static Function *function(void) {
     }
     cur->next = NULL;
 
-    return new_function(name, dummy.next, locals);
+    Function *fn = new_function(name, dummy.next, locals);
+    fn->tok = tok;
+    fn->end = token;
+    return fn;
 }
 
 // stmt = "return" expr ";"
@@ -354,9 +528,11 @@ static Function *function(void) {
 //      | expr ";"
 static Node  *stmt(void) {
     Node *node;
+    Token *tok = token; // 文の先頭のトークン
 
     if (consume("return")) {
         node = new_node_binary(ND_RETURN, expr(), NULL);
+        node->tok = tok;
         expect(";");
         return node;
     }
@@ -371,6 +547,7 @@ static Node  *stmt(void) {
             els = stmt();
         }
         node = new_node_if(cond, then, els);
+        node->tok = tok;
         return node;
     }
 
@@ -380,6 +557,7 @@ static Node  *stmt(void) {
         expect(")");
         Node *body = stmt();
         node = new_node_while(cond, body);
+        node->tok = tok;
         return node;
     }
 
@@ -387,7 +565,9 @@ static Node  *stmt(void) {
         expect("(");
         Node *init = NULL;
         if (!consume(";")) {
+            Token *t = token;
             init = new_node_binary(ND_EXPR_STMT, expr(), NULL);
+            init->tok = t;
             expect(";");
         }
         Node *cond = NULL;
@@ -397,11 +577,15 @@ static Node  *stmt(void) {
         }
         Node *inc = NULL;
         if (!consume(")")) {
+            Token *t = token;
             inc = new_node_binary(ND_EXPR_STMT, expr(), NULL);
+            inc->tok = t;
             expect(")");
         }
         Node *body = stmt();
-        return new_node_for(init, cond, inc, body);
+        node = new_node_for(init, cond, inc, body);
+        node->tok = tok;
+        return node;
     }
 
     if (consume("{")) {
@@ -416,146 +600,240 @@ static Node  *stmt(void) {
 
         Node *node = new_node(ND_BLOCK);
         node->block = head.next;
+        node->tok = tok;
 
         return node;
     }
 
     node = new_node_binary(ND_EXPR_STMT, expr(), NULL);
+    node->tok = tok;
     expect(";");
     return node;
 }
 
-// expr = assign
-static Node *expr(void) {
-    return assign();
+// 二項演算子
+typedef struct BinOp BinOp;
+struct BinOp {
+    char *symbol;
+    NodeKind kind;
+    int prec;    // 優先順位。大きいほど強く結合する
+    bool swap;   // 左右を入れ換えるか(">"は"<"の左右を入れ換えたものとみなす)
+    bool right;  // 右結合であるか
+};
+
+static BinOp binops[] = {
+    {"=", ND_ASSIGN, 1, false, true},
+    {"==", ND_EQ, 2},
+    {"!=", ND_NE, 2},
+    {"<", ND_LT, 3},
+    {"<=", ND_LE, 3},
+    {">", ND_LT, 3, true},
+    {">=", ND_LE, 3, true},
+    {"+", ND_ADD, 4},
+    {"-", ND_SUB, 4},
+    {"*", ND_MUL, 5},
+    {"/", ND_DIV, 5},
+};
+
+// 単項の"-"の優先順位。どの二項演算子よりも強く結合する
+#define PREC_NEG 6
+
+// 演算子スタックの要素の種類
+typedef enum {
+    PD_BINARY,  // 二項演算子
+    PD_NEG,     // 単項の"-"
+    PD_PAREN,   // 開き括弧
+    PD_CALL,    // 引数を読んでいる途中の関数呼び出し
+} PendingKind;
+
+// 演算子スタックの要素。右辺を読み終えるまで還元を待っている
+typedef struct Pending Pending;
+struct Pending {
+    PendingKind kind;
+    BinOp *op;      // PD_BINARYのときに使う
+    Node *call;     // PD_CALLのときに使う
+    Node *last_arg; // PD_CALLのとき、これまでに読んだ最後の引数
+};
+
+// 式の解析に使うスタック。入れ子の深さはヒープの大きさだけで制限される
+static Node **operands;
+static int noperands;
+static int cap_operands;
+static Pending *pendings;
+static int npendings;
+static int cap_pendings;
+
+static void push_operand(Node *node) {
+    if (noperands == cap_operands) {
+        cap_operands = cap_operands == 0 ? 64 : cap_operands * 2;
+        operands = realloc(operands, sizeof(Node *) * cap_operands);
+    }
+    operands[noperands++] = node;
 }
 
-// assign = equality ("=" assign)?
-static Node *assign(void) {
-    Node *node = equality();
-    if (consume("=")) {
-        node = new_node_binary(ND_ASSIGN, node, assign());
+static void push_pending(PendingKind kind, BinOp *op, Node *call) {
+    if (npendings == cap_pendings) {
+        cap_pendings = cap_pendings == 0 ? 64 : cap_pendings * 2;
+        pendings = realloc(pendings, sizeof(Pending) * cap_pendings);
     }
-    return node;
+    pendings[npendings++] = (Pending){kind, op, call, NULL};
 }
 
-// equality = relational ("==" relational | "!=" relational)*
-static Node *equality(void) {
-    Node *node = relational();
-    for(;;) {
-        if (consume("==")) {
-            node = new_node_binary(ND_EQ, node, relational());
-        } else if (consume("!=")) {
-            node = new_node_binary(ND_NE, node, relational());
-        } else {
-            return node;
-        }
+static int pending_prec(Pending *pd) {
+    switch (pd->kind) {
+        case PD_BINARY:
+            return pd->op->prec;
+        case PD_NEG:
+            return PREC_NEG;
+        default:
+            return 0; // 括弧と関数呼び出しは還元の境界となる
     }
 }
 
-// relational = add ("<" add | "<=" add | ">" add | ">=" add)*
-static Node *relational(void) {
-    Node *node = add();
-    for (;;) {
-        if (consume("<")) {
-            node = new_node_binary(ND_LT, node, add());
-        } else if (consume("<=")) {
-            node = new_node_binary(ND_LE, node, add());
-        } else if (consume(">")) {
-            node = new_node_binary(ND_LT, add(), node);    // ">"は"<"の左右を入れ換えたもの
-        } else if (consume(">=")) {
-            node = new_node_binary(ND_LE, add(), node); // ">="もまた同様とみなす
-        } else {
-            return node;
-        }
+// 演算子スタックの先頭の演算子を還元し、その結果をオペランドスタックに積む
+static void reduce(void) {
+    Pending *pd = &pendings[--npendings];
+    Node *rhs = operands[--noperands];
+    if (pd->kind == PD_NEG) {
+        push_operand(new_node_binary(ND_SUB, new_node_num(0), rhs));
+        return;
+    }
+    Node *lhs = operands[--noperands];
+    if (pd->op->swap) {
+        push_operand(new_node_binary(pd->op->kind, rhs, lhs));
+    } else {
+        push_operand(new_node_binary(pd->op->kind, lhs, rhs));
     }
 }
 
-// add = mul ("+" mul | "-" mul)*
-static Node *add(void) {
-    Node *node = mul();
-    for (;;) {
-        if (consume("+")) {
-            node = new_node_binary(ND_ADD, node, mul());
-        } else if (consume("-")) {
-            node = new_node_binary(ND_SUB, node, mul());
-        } else {
-            return node;
-        }
+// 括弧か関数呼び出しに達するまで還元する
+static void reduce_group(void) {
+    while (pending_prec(&pendings[npendings - 1]) > 0) {
+        reduce();
     }
 }
 
-// mul = unary ("*" unary | "/" unary)*
-static Node *mul(void) {
-    Node *node = unary();
-    for (;;) {
-        if (consume("*")) {
-            node = new_node_binary(ND_MUL, node, unary());
-        } else if(consume("/")) {
-            node = new_node_binary(ND_DIV, node, unary());
-        } else {
-            return node;
-        }
+// 読み終えた引数を、読んでいる途中の関数呼び出しに加える
+static void add_arg(Pending *pd) {
+    Node *arg = operands[--noperands];
+    if (pd->last_arg == NULL) {
+        pd->call->args = arg;
+    } else {
+        pd->last_arg->next = arg;
     }
+    pd->last_arg = arg;
 }
 
-// unary = ("+" | "-")? primary
-static Node *unary(void) {
-    if (consume("+")) {
-        return unary();
+static BinOp *peek_binop(void) {
+    if (token->kind != TK_RESERVED) {
+        return NULL;
     }
-    if (consume("-")) {
-        return new_node_binary(ND_SUB, new_node_num(0), unary());
+    for (int i = 0; i < sizeof(binops) / sizeof(binops[0]); i++) {
+        if (strlen(binops[i].symbol) == token->len && memcmp(token->str, binops[i].symbol, token->len) == 0) {
+            return &binops[i];
+        }
     }
-    return primary();
+    return NULL;
 }
 
-// primary = num | ident func-args? | "(" expr ")"
-static Node *primary(void) {
-    // 括弧で囲まれている場合
-    if (consume("(")) {
-        Node *node = expr();
-        expect(")");
-        return node;
-    }
+// 次の文法の式を、再帰を使わずに演算子順位法で解析する。
+//
+// expr       = assign
+// assign     = equality ("=" assign)?
+// equality   = relational ("==" relational | "!=" relational)*
+// relational = add ("<" add | "<=" add | ">" add | ">=" add)*
+// add        = mul ("+" mul | "-" mul)*
+// mul        = unary ("*" unary | "/" unary)*
+// unary      = ("+" | "-")? primary
+// primary    = num | ident func-args? | "(" expr ")"
+// func-args  = "(" (assign ("," assign)*)? ")"
+static Node *expr(void) {
+    int base_pendings = npendings;
+    int depth = 0; // 閉じていない括弧と関数呼び出しの数
 
-    Token *tok = consume_ident();
-    if (tok != NULL) {
-        // 関数呼び出しの場合
+    for (;;) {
+        // 前置演算子とオペランドを読む
+        if (consume("+")) {
+            continue;
+        }
+        if (consume("-")) {
+            push_pending(PD_NEG, NULL, NULL);
+            continue;
+        }
         if (consume("(")) {
-            Node *node = new_node(ND_FUNCALL);
-            node->funcname = strndup(tok->str,tok->len);
-            node->args = func_args();
-            return node;
+            push_pending(PD_PAREN, NULL, NULL);
+            depth++;
+            continue;
         }
 
-        // 既出の変数ならばそれを参照させ、そうでなければ新規の変数として扱う
-        LVar *lvar = find_lvar(tok);
-        if (lvar == NULL) {
-            lvar = new_lvar(tok);
+        Token *tok = consume_ident();
+        if (tok != NULL) {
+            if (consume("(")) {
+                // 関数呼び出しの場合
+                Node *node = new_node(ND_FUNCALL);
+                node->funcname = strndup(tok->str,tok->len);
+                node->tok = tok;
+                if (!consume(")")) {
+                    push_pending(PD_CALL, NULL, node);
+                    depth++;
+                    continue;
+                }
+                push_operand(node);
+            } else {
+                // 既出の変数ならばそれを参照させ、そうでなければ新規の変数として扱う
+                LVar *lvar = find_lvar(tok);
+                if (lvar == NULL) {
+                    lvar = new_lvar(tok);
+                }
+                push_operand(new_node_lvar(lvar));
+            }
+        } else {
+            // そうでなければ数値でなければならない
+            push_operand(new_node_num(expect_number()));
         }
-        return new_node_lvar(lvar);
-    }
 
-    // そうでなければ数値でなければならない
-    return new_node_num(expect_number());
-}
+        // 二項演算子を読む。閉じ括弧や","で部分式が終わることもある
+        for (;;) {
+            BinOp *op = peek_binop();
+            if (op != NULL) {
+                token = token->next;
+                while (npendings > base_pendings) {
+                    int prec = pending_prec(&pendings[npendings - 1]);
+                    if (prec < op->prec || (prec == op->prec && op->right)) {
+                        break;
+                    }
+                    reduce();
+                }
+                push_pending(PD_BINARY, op, NULL);
+                break;
+            }
 
-// func-args = "(" (assign ("," assign)*)? ")"
-static Node *func_args(void) {
-    // "("の存在はprimaryで検査している
-    if (consume(")")) {
-        return NULL;
-    }
+            if (depth > 0 && consume(")")) {
+                reduce_group();
+                Pending *pd = &pendings[--npendings];
+                depth--;
+                if (pd->kind == PD_CALL) {
+                    add_arg(pd);
+                    push_operand(pd->call);
+                }
+                continue;
+            }
 
-    Node *head = assign();
-    Node *cur = head;
-    while (consume(",")) {
-        cur->next = assign();
-        cur = cur->next;
-    }
-    cur->next = NULL;
-    expect(")");
+            // 関数呼び出しの中では","の後に次の引数が続く
+            if (depth > 0) {
+                reduce_group();
+                if (pendings[npendings - 1].kind == PD_PAREN) {
+                    error_at(token->str, "')'ではありません");
+                }
+                expect(",");
+                add_arg(&pendings[npendings - 1]);
+                break;
+            }
 
-    return head;
+            while (npendings > base_pendings) {
+                reduce();
+            }
+            return operands[--noperands];
+        }
+    }
 }
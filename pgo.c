@@ -0,0 +1,324 @@
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
+#include "9cc.h"
+
+// 呼び出し回数がこれ以上の呼び出しをインライン展開する
+#define INLINE_MIN_CALLS 100
+
+// ノード数がこれ以下の関数だけをインライン展開する
+#define INLINE_MAX_NODES 64
+
+// プロファイルに情報がないループの反復回数の見積もり
+#define DEFAULT_LOOP_TRIPS 10
+
+// ローカル変数に割り当てる呼び出し先保存レジスタ
+static Reg var_regs[MAX_REG_VARS] = {RBX, R12, R13, R14, R15};
+
+// プロファイルの1行
+typedef struct ProfEntry ProfEntry;
+struct ProfEntry {
+    ProfEntry *next;
+    char *kind;   // "func", "if", "while", "for"
+    char *name;   // 関数名。分岐ならばNULL
+    int line;
+    int col;
+    long count0;  // 関数は呼び出し回数、ifは実行回数、ループは開始回数
+    long count1;  // 関数はサイクル数、ifはthen節の実行回数、ループは反復回数
+};
+
+// プロファイルを読み込んだか
+bool profile_loaded = false;
+
+static ProfEntry *entries;
+
+static ProfEntry *find_entry(char *kind, char *name, int line, int col) {
+    for (ProfEntry *e = entries; e != NULL; e = e->next) {
+        if (strcmp(e->kind, kind) == 0 && e->line == line && e->col == col &&
+            (name == NULL || strcmp(e->name, name) == 0)) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+// 同じ位置の行は足し合わせる。複数回の実行の結果を追記したプロファイルもそのまま使える
+static void add_entry(char *kind, char *name, int line, int col, long c0, long c1) {
+    ProfEntry *e = find_entry(kind, name, line, col);
+    if (e == NULL) {
+        e = calloc(1, sizeof(ProfEntry));
+        e->kind = strdup(kind);
+        e->name = name != NULL ? strdup(name) : NULL;
+        e->line = line;
+        e->col = col;
+        e->next = entries;
+        entries = e;
+    }
+    e->count0 += c0;
+    e->count1 += c1;
+}
+
+// -finstrumentで書き出したプロファイルを読み込む
+void load_profile(char *path) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        error("%sを開けません: %s", path, strerror(errno));
+    }
+
+    char buf[1024];
+    while (fgets(buf, sizeof(buf), fp) != NULL) {
+        char kind[16], name[256];
+        int line, col;
+        long c0, c1;
+        if (sscanf(buf, "func %255s %d:%d %ld %ld", name, &line, &col, &c0, &c1) == 5) {
+            add_entry("func", name, line, col, c0, c1);
+        } else if (sscanf(buf, "branch %15s %d:%d %ld %ld", kind, &line, &col, &c0, &c1) == 5) {
+            add_entry(kind, NULL, line, col, c0, c1);
+        } else {
+            error("プロファイルの形式が正しくありません: %s", buf);
+        }
+    }
+    fclose(fp);
+    profile_loaded = true;
+}
+
+static ProfEntry *branch_entry(Node *node) {
+    if (node->tok == NULL) {
+        return NULL;
+    }
+    char *kind = node->kind == ND_IF ? "if" : node->kind == ND_WHILE ? "while" : "for";
+    return find_entry(kind, NULL, node->tok->line, node->tok->col);
+}
+
+static long function_calls(Function *fn) {
+    ProfEntry *e = find_entry("func", fn->name, fn->tok->line, fn->tok->col);
+    return e != NULL ? e->count0 : 0;
+}
+
+// then節が実行される割合。分からなければ1/2とする
+static double then_ratio(Node *node) {
+    ProfEntry *e = branch_entry(node);
+    if (e == NULL || e->count0 == 0) {
+        return 0.5;
+    }
+    return (double)e->count1 / e->count0;
+}
+
+// ループの1回の開始あたりの反復回数
+static double loop_trips(Node *node) {
+    ProfEntry *e = branch_entry(node);
+    if (e == NULL || e->count0 == 0) {
+        return DEFAULT_LOOP_TRIPS;
+    }
+    return (double)e->count1 / e->count0;
+}
+
+// then節が実行されることの方が少なければ真を返す。コード生成器はthen節を関数の末尾に追い出す
+bool pgo_then_is_cold(Node *node) {
+    ProfEntry *e = branch_entry(node);
+    return e != NULL && e->count1 * 2 < e->count0;
+}
+
+static void walk(Node *node, double freq, void (*visit)(Node *node, double freq));
+
+// 式を辿るときの状態。式の中では実行頻度は変わらない
+typedef struct ExprWalk ExprWalk;
+struct ExprWalk {
+    double freq;
+    void (*visit)(Node *node, double freq);
+};
+
+static bool visit_expr(Node *node, void *arg) {
+    ExprWalk *w = arg;
+    w->visit(node, w->freq);
+    for (Node *n = node->inlined; n != NULL; n = n->next) {
+        walk(n, w->freq, w->visit);
+    }
+    return false;
+}
+
+// 木を辿り、文の実行頻度の見積もりfreqとともにvisitを呼ぶ。
+// freqは関数の1回の呼び出しあたりの実行回数である。
+// 文はgenと同じく再帰で辿り、深く入れ子になりうる式はwalk_nodesで辿る
+static void walk(Node *node, double freq, void (*visit)(Node *node, double freq)) {
+    if (node == NULL) {
+        return;
+    }
+
+    switch (node->kind) {
+        case ND_IF: {
+            double p = then_ratio(node);
+            visit(node, freq);
+            walk(node->cond, freq, visit);
+            walk(node->then, freq * p, visit);
+            walk(node->els, freq * (1 - p), visit);
+            return;
+        }
+        case ND_WHILE:
+        case ND_FOR: {
+            double trips = loop_trips(node);
+            visit(node, freq);
+            walk(node->init, freq, visit);
+            walk(node->cond, freq * (trips + 1), visit);
+            walk(node->body, freq * trips, visit);
+            walk(node->inc, freq * trips, visit);
+            return;
+        }
+        case ND_BLOCK:
+            visit(node, freq);
+            for (Node *b = node->block; b != NULL; b = b->next) {
+                walk(b, freq, visit);
+            }
+            return;
+        case ND_RETURN:
+        case ND_EXPR_STMT:
+            visit(node, freq);
+            walk(node->lhs, freq, visit);
+            return;
+    }
+
+    ExprWalk w = {freq, visit};
+    walk_nodes(node, false, visit_expr, &w);
+}
+
+static void weigh_var(Node *node, double freq) {
+    if (node->kind == ND_LVAR) {
+        node->var->weight += freq;
+    }
+}
+
+// 実行頻度の高いローカル変数を呼び出し先保存レジスタに割り当てる。
+// 割り当てたレジスタをregsに入れ、その個数を返す
+int pgo_assign_registers(Function *fn, Reg *regs) {
+    for (LVar *var = fn->locals; var != NULL; var = var->next) {
+        var->weight = 0;
+        var->in_reg = false;
+    }
+    for (Node *n = fn->nodes; n != NULL; n = n->next) {
+        walk(n, 1, weigh_var);
+    }
+
+    int nregs = 0;
+    while (nregs < MAX_REG_VARS) {
+        LVar *best = NULL;
+        for (LVar *var = fn->locals; var != NULL; var = var->next) {
+            if (!var->in_reg && var->weight > 0 && (best == NULL || var->weight > best->weight)) {
+                best = var;
+            }
+        }
+        if (best == NULL) {
+            break;
+        }
+        best->in_reg = true;
+        best->reg = var_regs[nregs];
+        regs[nregs++] = best->reg;
+    }
+    return nregs;
+}
+
+// インライン展開の対象を探すための状態
+static Function *functions;
+static Function *caller;
+static long caller_calls;
+
+// 呼び出し先のローカル変数と、呼び出し元に用意したその複製の対応
+typedef struct VarMap VarMap;
+struct VarMap {
+    VarMap *next;
+    LVar *from;
+    LVar *to;
+};
+
+static VarMap *varmap;
+
+// 呼び出し先の変数に対応する呼び出し元の変数を返す。なければ作る
+static LVar *map_var(LVar *var) {
+    for (VarMap *m = varmap; m != NULL; m = m->next) {
+        if (m->from == var) {
+            return m->to;
+        }
+    }
+
+    LVar *v = calloc(1, sizeof(LVar));
+    v->name = var->name;
+    v->len = var->len;
+    v->next = caller->locals;
+    caller->locals = v;
+
+    VarMap *m = calloc(1, sizeof(VarMap));
+    m->from = var;
+    m->to = v;
+    m->next = varmap;
+    varmap = m;
+    return v;
+}
+
+static bool is_call_to(Node *node, void *name) {
+    return node->kind == ND_FUNCALL && strcmp(node->funcname, name) == 0;
+}
+
+static bool calls_function(Node *node, char *name) {
+    return walk_nodes(node, false, is_call_to, name);
+}
+
+// 小さく、自分自身を呼ばない関数だけをインライン展開できる
+static bool can_inline(Function *fn) {
+    int size = 0;
+    for (Node *n = fn->nodes; n != NULL; n = n->next) {
+        size += count_nodes(n);
+        if (calls_function(n, fn->name)) {
+            return false;
+        }
+    }
+    return size <= INLINE_MAX_NODES;
+}
+
+// 展開する呼び出し
+typedef struct CallSite CallSite;
+struct CallSite {
+    CallSite *next;
+    Node *node;
+    Function *callee;
+};
+
+static CallSite *call_sites;
+
+static void find_hot_call(Node *node, double freq) {
+    if (node->kind != ND_FUNCALL || node->inlined != NULL) {
+        return;
+    }
+    if (freq * caller_calls < INLINE_MIN_CALLS) {
+        return;
+    }
+    Function *callee = find_function(functions, node->funcname);
+    if (callee == NULL || callee == caller || !can_inline(callee)) {
+        return;
+    }
+
+    CallSite *cs = calloc(1, sizeof(CallSite));
+    cs->node = node;
+    cs->callee = callee;
+    cs->next = call_sites;
+    call_sites = cs;
+}
+
+// 実行回数の多い呼び出しを、呼び出し先の本体の複製で置き換える。
+// 展開は1段だけで、展開した本体の中の呼び出しはそのまま残す。
+void pgo_inline(Function *prog) {
+    functions = prog;
+    for (Function *fn = prog; fn != NULL; fn = fn->next) {
+        caller = fn;
+        caller_calls = function_calls(fn);
+        if (caller_calls == 0) {
+            continue;
+        }
+
+        // 展開した本体の中を辿らないよう、呼び出しを集め終えてから展開する
+        call_sites = NULL;
+        for (Node *n = fn->nodes; n != NULL; n = n->next) {
+            walk(n, 1, find_hot_call);
+        }
+        for (CallSite *cs = call_sites; cs != NULL; cs = cs->next) {
+            varmap = NULL;
+            cs->node->inlined = copy_list(cs->callee->nodes, map_var);
+        }
+    }
+}
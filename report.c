@@ -0,0 +1,160 @@
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
+#include "9cc.h"
+#include <sys/resource.h>
+#include <time.h>
+
+// 記録できるフェーズの数の上限
+#define MAX_PHASES 16
+
+// フェーズごとの計測結果
+typedef struct Phase Phase;
+struct Phase {
+    char *name;
+    double wall;      // 経過時間(秒)
+    double cpu;       // CPU時間(秒)
+    long alloc_bytes;         // このフェーズでmalloc、calloc、reallocに要求したバイト数
+    long process_peak_rss_kb; // プロセスの開始からこのフェーズの終了までの最大常駐セットサイズ(KB)
+    long nodes;       // このフェーズの終了時点でのノード数。数えていなければ-1
+};
+
+static Phase phases[MAX_PHASES];
+static int nphases;
+
+// 計測中のフェーズの開始時点の値
+static double start_wall;
+static double start_cpu;
+static long start_alloc_bytes;
+
+// これまでにmalloc、calloc、reallocに要求したバイト数の合計。reallocは新しい大きさを数える。
+// リンク時に--wrapで9ccの中の呼び出しをこれらのラッパーに差し替えて数える
+static long alloc_bytes;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    alloc_bytes += size;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+    alloc_bytes += n * size;
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size) {
+    alloc_bytes += size;
+    return __real_realloc(p, size);
+}
+
+static double now(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long process_peak_rss_kb(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+
+static long count_program_nodes(Function *prog) {
+    long n = 0;
+    for (Function *fn = prog; fn != NULL; fn = fn->next) {
+        for (Node *node = fn->nodes; node != NULL; node = node->next) {
+            n += count_nodes(node);
+        }
+    }
+    return n;
+}
+
+// フェーズの計測を開始する
+void phase_begin(char *name) {
+    if (!opt_time_report) {
+        return;
+    }
+    if (nphases == MAX_PHASES) {
+        error("フェーズが多すぎます");
+    }
+    phases[nphases].name = name;
+    start_alloc_bytes = alloc_bytes;
+    start_cpu = now(CLOCK_PROCESS_CPUTIME_ID);
+    start_wall = now(CLOCK_MONOTONIC);
+}
+
+// フェーズの計測を終える。progを渡すとその時点のノード数も記録する
+void phase_end(Function *prog) {
+    if (!opt_time_report) {
+        return;
+    }
+    Phase *ph = &phases[nphases++];
+    ph->wall = now(CLOCK_MONOTONIC) - start_wall;
+    ph->cpu = now(CLOCK_PROCESS_CPUTIME_ID) - start_cpu;
+    ph->alloc_bytes = alloc_bytes - start_alloc_bytes;
+    ph->process_peak_rss_kb = process_peak_rss_kb();
+    ph->nodes = prog != NULL ? count_program_nodes(prog) : -1;
+}
+
+static void print_text(long ntokens, long nfuncs, long nodes) {
+    Phase total = {.name = "total"};
+
+    fprintf(stderr, "%-12s %10s %10s %12s %17s %10s\n",
+            "phase", "wall(ms)", "cpu(ms)", "alloc(KB)", "proc peak RSS(KB)", "nodes");
+    for (int i = 0; i < nphases; i++) {
+        Phase *ph = &phases[i];
+        fprintf(stderr, "%-12s %10.3f %10.3f %12.1f %17ld ",
+                ph->name, ph->wall * 1e3, ph->cpu * 1e3, ph->alloc_bytes / 1024.0, ph->process_peak_rss_kb);
+        if (ph->nodes >= 0) {
+            fprintf(stderr, "%10ld\n", ph->nodes);
+        } else {
+            fprintf(stderr, "%10s\n", "-");
+        }
+        total.wall += ph->wall;
+        total.cpu += ph->cpu;
+        total.alloc_bytes += ph->alloc_bytes;
+        total.process_peak_rss_kb = ph->process_peak_rss_kb;
+    }
+    fprintf(stderr, "%-12s %10.3f %10.3f %12.1f %17ld %10ld\n",
+            total.name, total.wall * 1e3, total.cpu * 1e3, total.alloc_bytes / 1024.0, total.process_peak_rss_kb, nodes);
+    fprintf(stderr, "tokens: %ld, nodes: %ld, functions: %ld\n", ntokens, nodes, nfuncs);
+}
+
+static void print_json(long ntokens, long nfuncs, long nodes) {
+    fprintf(stderr, "{\"tokens\": %ld, \"nodes\": %ld, \"functions\": %ld, \"phases\": [", ntokens, nodes, nfuncs);
+    for (int i = 0; i < nphases; i++) {
+        Phase *ph = &phases[i];
+        fprintf(stderr, "%s{\"name\": \"%s\", \"wall_ms\": %.6f, \"cpu_ms\": %.6f, "
+                "\"alloc_bytes\": %ld, \"process_peak_rss_kb\": %ld",
+                i == 0 ? "" : ", ", ph->name, ph->wall * 1e3, ph->cpu * 1e3, ph->alloc_bytes, ph->process_peak_rss_kb);
+        if (ph->nodes >= 0) {
+            fprintf(stderr, ", \"nodes\": %ld", ph->nodes);
+        }
+        fprintf(stderr, "}");
+    }
+    fprintf(stderr, "]}\n");
+}
+
+// 計測結果を標準エラー出力に表示する
+void print_time_report(Token *tok, Function *prog) {
+    if (!opt_time_report) {
+        return;
+    }
+
+    long ntokens = 0;
+    for (Token *t = tok; t != NULL && t->kind != TK_EOF; t = t->next) {
+        ntokens++;
+    }
+    long nfuncs = 0;
+    for (Function *fn = prog; fn != NULL; fn = fn->next) {
+        nfuncs++;
+    }
+    long nodes = count_program_nodes(prog);
+
+    if (opt_time_report_json) {
+        print_json(ntokens, nfuncs, nodes);
+    } else {
+        print_text(ntokens, nfuncs, nodes);
+    }
+}
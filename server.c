@@ -0,0 +1,567 @@
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
+#define _GNU_SOURCE
+#include "9cc.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// キャッシュの表の大きさ
+#define CACHE_TABLE_SIZE 4096
+
+// 関数ごとに生成したアセンブリ
+typedef struct CacheEntry CacheEntry;
+struct CacheEntry {
+    CacheEntry *next;
+    uint64_t hash;  // keyのハッシュ値。表を引くのに使う
+    char *key;      // 関数のトークン列とコンパイルオプション。同じ関数であるかはこれで判定する
+    int keylen;
+    char *text;
+    int len;
+};
+
+// 子プロセスから親プロセスへ送るキャッシュの更新。
+// 'h'はキャッシュが当たったことを、'm'は外れて生成したtextを登録することを表す。
+// 'm'の後にはkeylenバイトのkeyとlenバイトのtextが続く
+typedef struct CacheRecord CacheRecord;
+struct CacheRecord {
+    char kind;
+    uint64_t hash;
+    int keylen;
+    int len;
+};
+
+static CacheEntry *cache[CACHE_TABLE_SIZE];
+static long hits;
+static long misses;
+static long nentries;
+
+// コンパイル要求を処理する子プロセスで、キャッシュの更新を親へ送るパイプ。それ以外では-1
+static int cache_fd = -1;
+
+// キャッシュの外れた関数を生成している間の出力先と、その関数のキー
+static FILE *saved_output;
+static char *func_text;
+static size_t func_len;
+static char *func_key;
+static size_t func_keylen;
+static uint64_t func_hash;
+
+static uint64_t fnv(void *p, size_t n) {
+    unsigned char *s = p;
+    uint64_t h = 14695981039346656037u;
+    for (size_t i = 0; i < n; i++) {
+        h = (h ^ s[i]) * 1099511628211u;
+    }
+    return h;
+}
+
+// 関数の出力は、その関数のトークン列と次のオプションだけで決まる。それらを並べたキーを作る。
+// 位置はデバッグ情報を出力するときだけ出力に影響する
+static char *function_key(Function *fn, size_t *len) {
+    char *key;
+    FILE *fp = open_memstream(&key, len);
+    fprintf(fp, "unroll=%d g=%d", opt_unroll_factor, opt_debug_info);
+    fputc('\0', fp);
+    for (Token *tok = fn->tok; tok != fn->end; tok = tok->next) {
+        fwrite(&tok->kind, sizeof(tok->kind), 1, fp);
+        fwrite(&tok->len, sizeof(tok->len), 1, fp);
+        fwrite(tok->str, 1, tok->len, fp);
+        if (opt_debug_info) {
+            fwrite(&tok->line, sizeof(tok->line), 1, fp);
+            fwrite(&tok->col, sizeof(tok->col), 1, fp);
+        }
+    }
+    fclose(fp);
+    return key;
+}
+
+// 関数単位でキャッシュできるか。
+// 他の関数の本体に依存する最適化や、プログラム全体で番号を振る計測を行なうときは使えない
+static bool cache_enabled(void) {
+    return cache_fd >= 0 && !emit_machine_code && !opt_instrument &&
+        !opt_fold_pure_calls && opt_profile_use == NULL;
+}
+
+// キーの一致するエントリを探す。ハッシュ値が衝突しても別の関数の出力は返さない
+static CacheEntry *find_entry(uint64_t hash, char *key, int keylen) {
+    for (CacheEntry *e = cache[hash % CACHE_TABLE_SIZE]; e != NULL; e = e->next) {
+        if (e->hash == hash && e->keylen == keylen && memcmp(e->key, key, keylen) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void add_entry(uint64_t hash, char *key, int keylen, char *text, int len) {
+    CacheEntry *e = find_entry(hash, key, keylen);
+    if (e == NULL) {
+        e = calloc(1, sizeof(CacheEntry));
+        e->hash = hash;
+        e->key = key;
+        e->keylen = keylen;
+        e->next = cache[hash % CACHE_TABLE_SIZE];
+        cache[hash % CACHE_TABLE_SIZE] = e;
+        nentries++;
+    } else {
+        free(key);
+        free(e->text);
+    }
+    e->text = text;
+    e->len = len;
+}
+
+static void write_all(int fd, void *p, size_t n) {
+    char *s = p;
+    while (n > 0) {
+        ssize_t w = write(fd, s, n);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error("書き込みに失敗しました: %s", strerror(errno));
+        }
+        s += w;
+        n -= w;
+    }
+}
+
+// n バイトを読む。その前に終端に達したら偽を返す
+static bool read_all(int fd, void *p, size_t n) {
+    char *s = p;
+    while (n > 0) {
+        ssize_t r = read(fd, s, n);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return false;
+        }
+        s += r;
+        n -= r;
+    }
+    return true;
+}
+
+static void send_record(char kind, char *text, int len) {
+    CacheRecord rec = {kind, func_hash, kind == 'm' ? func_keylen : 0, len};
+    write_all(cache_fd, &rec, sizeof(rec));
+    write_all(cache_fd, func_key, rec.keylen);
+    write_all(cache_fd, text, len);
+}
+
+// 関数の出力がキャッシュにあればそれを出力して真を返す
+bool cache_lookup(Function *fn) {
+    if (!cache_enabled()) {
+        return false;
+    }
+    free(func_key);
+    func_key = function_key(fn, &func_keylen);
+    func_hash = fnv(func_key, func_keylen);
+    CacheEntry *e = find_entry(func_hash, func_key, func_keylen);
+    if (e == NULL) {
+        return false;
+    }
+    fwrite(e->text, 1, e->len, output);
+    send_record('h', NULL, 0);
+    return true;
+}
+
+// キャッシュの外れた関数の出力を横取りし始める
+void cache_begin(void) {
+    if (!cache_enabled()) {
+        return;
+    }
+    saved_output = output;
+    output = open_memstream(&func_text, &func_len);
+}
+
+// 横取りした出力を本来の出力先に書き、親プロセスのキャッシュに登録させる
+void cache_end(void) {
+    if (!cache_enabled()) {
+        return;
+    }
+    fclose(output);
+    output = saved_output;
+    fwrite(func_text, 1, func_len, output);
+    send_record('m', func_text, func_len);
+    free(func_text);
+}
+
+// 子プロセスから送られたキャッシュの更新を取り込む。途中で切れたレコードは捨てる
+static void apply_records(char *p, size_t len) {
+    char *end = p + len;
+    while (end - p >= (long)sizeof(CacheRecord)) {
+        CacheRecord rec;
+        memcpy(&rec, p, sizeof(rec));
+        p += sizeof(rec);
+        if (rec.kind == 'h') {
+            hits++;
+            continue;
+        }
+        if (rec.keylen < 0 || rec.len < 0 || end - p < (long)rec.keylen + rec.len) {
+            return;
+        }
+        char *key = malloc(rec.keylen);
+        char *text = malloc(rec.len);
+        memcpy(key, p, rec.keylen);
+        memcpy(text, p + rec.keylen, rec.len);
+        p += rec.keylen + rec.len;
+        misses++;
+        add_entry(rec.hash, key, rec.keylen, text, rec.len);
+    }
+}
+
+// コンパイル中の要求。子プロセスの終了とパイプの終端の両方を見届けてから応答する
+typedef struct Job Job;
+struct Job {
+    Job *next;
+    pid_t pid;
+    int conn;       // クライアントとの接続
+    int pipe;       // 子プロセスからキャッシュの更新を受け取るパイプ。読み終えたら-1
+    char *records;  // 受け取ったキャッシュの更新
+    size_t len;
+    size_t cap;
+    bool exited;
+    int status;     // 子プロセスの終了ステータス
+};
+
+static Job *jobs;
+
+// SIGCHLDを受けたことをpollに知らせるパイプ
+static int sigchld_pipe[2];
+
+static void on_sigchld(int sig) {
+    int saved = errno;
+    if (write(sigchld_pipe[1], "", 1) < 0) {
+        // パイプが一杯ならば、既に知らせてある
+    }
+    errno = saved;
+}
+
+// パイプに届いたキャッシュの更新を読む
+static void read_job(Job *job) {
+    if (job->len == job->cap) {
+        job->cap = job->cap == 0 ? 4096 : job->cap * 2;
+        job->records = realloc(job->records, job->cap);
+    }
+    ssize_t n = read(job->pipe, job->records + job->len, job->cap - job->len);
+    if (n < 0 && errno == EINTR) {
+        return;
+    }
+    if (n <= 0) {
+        close(job->pipe);
+        job->pipe = -1;
+        return;
+    }
+    job->len += n;
+}
+
+// 終了した子プロセスを待たずに回収する
+static void reap_children(void) {
+    char buf[64];
+    while (read(sigchld_pipe[0], buf, sizeof(buf)) > 0) {
+    }
+
+    int wstatus;
+    pid_t pid;
+    while ((pid = waitpid(-1, &wstatus, WNOHANG)) > 0) {
+        for (Job *job = jobs; job != NULL; job = job->next) {
+            if (job->pid == pid) {
+                job->exited = true;
+                job->status = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 128 + WTERMSIG(wstatus);
+            }
+        }
+    }
+}
+
+// 終わった要求のキャッシュの更新を取り込み、クライアントに終了ステータスを返す。
+// クライアントが既に切断していても構わない
+static void finish_jobs(void) {
+    for (Job **p = &jobs; *p != NULL;) {
+        Job *job = *p;
+        if (!job->exited || job->pipe >= 0) {
+            p = &job->next;
+            continue;
+        }
+        apply_records(job->records, job->len);
+        if (write(job->conn, &job->status, sizeof(job->status)) < 0) {
+            // 応答を待たずに切断した
+        }
+        close(job->conn);
+        *p = job->next;
+        free(job->records);
+        free(job);
+    }
+}
+
+// 子プロセスでコンパイルを始める。子プロセスは他の要求のディスクリプタを全て閉じ、
+// クライアントの標準入出力とエラー出力、作業ディレクトリでコンパイラを実行する
+static void start_job(int conn, int sock, int *fds, char *cwd, int argc, char **argv) {
+    int pipefd[2];
+    if (pipe(pipefd) != 0) {
+        error("パイプを作れません: %s", strerror(errno));
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        error("プロセスを作れません: %s", strerror(errno));
+    }
+    if (pid == 0) {
+        signal(SIGCHLD, SIG_DFL);
+        close(sock);
+        close(sigchld_pipe[0]);
+        close(sigchld_pipe[1]);
+        for (Job *job = jobs; job != NULL; job = job->next) {
+            close(job->conn);
+            if (job->pipe >= 0) {
+                close(job->pipe);
+            }
+        }
+        close(conn);
+        close(pipefd[0]);
+        for (int i = 0; i < 3; i++) {
+            dup2(fds[i], i);
+            close(fds[i]);
+        }
+        if (chdir(cwd) != 0) {
+            error("%sに移動できません: %s", cwd, strerror(errno));
+        }
+        cache_fd = pipefd[1];
+        exit(compiler_main(argc, argv));
+    }
+
+    close(pipefd[1]);
+    Job *job = calloc(1, sizeof(Job));
+    job->pid = pid;
+    job->conn = conn;
+    job->pipe = pipefd[0];
+    job->next = jobs;
+    jobs = job;
+}
+
+// 要求のペイロードの大きさの上限
+#define MAX_REQUEST_SIZE (16 * 1024 * 1024)
+
+// 要求に添えられたファイルディスクリプタを受け取る。
+// 標準入出力とエラー出力のちょうど3つでなければ、受け取ったものを全て閉じて偽を返す
+static bool receive_fds(int conn, uint32_t *len, int *fds) {
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * 3)];
+        struct cmsghdr align;
+    } cbuf;
+    struct iovec iov = {len, sizeof(*len)};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = cbuf.buf, .msg_controllen = sizeof(cbuf.buf)};
+    ssize_t n = recvmsg(conn, &msg, MSG_WAITALL);
+    if (n < 0) {
+        return false;
+    }
+
+    // 受け取ったディスクリプタの数。CMSG_SPACEの切り上げのため3つより多いこともある。
+    // 入りきらなかったものはカーネルが閉じ、MSG_CTRUNCが立つ
+    int nfds = 0;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len >= CMSG_LEN(0)) {
+        nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    }
+
+    if (n == sizeof(*len) && !(msg.msg_flags & MSG_CTRUNC) && nfds == 3 &&
+        cmsg->cmsg_len == CMSG_LEN(sizeof(int) * 3) && CMSG_NXTHDR(&msg, cmsg) == NULL) {
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * 3);
+        return true;
+    }
+    for (int i = 0; i < nfds; i++) {
+        int fd;
+        memcpy(&fd, CMSG_DATA(cmsg) + sizeof(int) * i, sizeof(fd));
+        close(fd);
+    }
+    return false;
+}
+
+// 1つの要求を受け付ける。要求はファイルディスクリプタ3つ(標準入出力とエラー出力)を添えた
+// ペイロードの長さ(uint32_t)と、NUL区切りの作業ディレクトリと引数の列からなる。
+// 応答は終了ステータス(int)である。形式の正しくない要求には応答せずに切断する。
+// コンパイルは子プロセスに任せ、その終了を待たずに戻る。サーバを止める要求ならば真を返す
+static bool serve(int conn, int sock) {
+    uint32_t len;
+    int fds[3];
+    if (!receive_fds(conn, &len, fds)) {
+        close(conn);
+        return false;
+    }
+
+    char *payload = NULL;
+    char **argv = NULL;
+    bool stop = false;
+    if (len == 0 || len > MAX_REQUEST_SIZE) {
+        goto reject;
+    }
+    payload = malloc(len);
+    if (!read_all(conn, payload, len) || payload[len - 1] != '\0') {
+        goto reject;
+    }
+
+    // argv[0]は9cc、その後に引数が続く
+    char *cwd = payload;
+    int argc = 1;
+    argv = calloc(len + 1, sizeof(char *));
+    argv[0] = "9cc";
+    for (char *p = cwd + strlen(cwd) + 1; p < payload + len; p += strlen(p) + 1) {
+        argv[argc++] = p;
+    }
+
+    int status = 0;
+    if (argc == 2 && strcmp(argv[1], "--server-stats") == 0) {
+        dprintf(fds[1], "hits %ld\nmisses %ld\nentries %ld\n", hits, misses, nentries);
+    } else if (argc == 2 && strcmp(argv[1], "--server-stop") == 0) {
+        stop = true;
+    } else {
+        start_job(conn, sock, fds, cwd, argc, argv);
+        conn = -1;
+    }
+    if (conn >= 0 && write(conn, &status, sizeof(status)) < 0) {
+        // 応答を待たずに切断した
+    }
+
+reject:
+    free(argv);
+    free(payload);
+    for (int i = 0; i < 3; i++) {
+        close(fds[i]);
+    }
+    if (conn >= 0) {
+        close(conn);
+    }
+    return stop;
+}
+
+static void socket_address(struct sockaddr_un *addr, char *path) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        error("ソケットのパスが長すぎます: %s", path);
+    }
+    strcpy(addr->sun_path, path);
+}
+
+// Unixドメインソケットpathで要求を待ち、要求ごとに子プロセスでコンパイルする。
+// 子プロセスの終了を待たずに次の要求を受け付けるので、複数のクライアントを並行して処理できる。
+// 生成したアセンブリは関数ごとにキャッシュし、変更のない関数は再利用する
+void run_server(char *path) {
+    struct sockaddr_un addr;
+    socket_address(&addr, path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        error("ソケットを作れません: %s", strerror(errno));
+    }
+    unlink(path);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(sock, 64) != 0) {
+        error("%sで待ち受けられません: %s", path, strerror(errno));
+    }
+    // 応答を待たずに切断したクライアントのせいで終了しないようにする
+    signal(SIGPIPE, SIG_IGN);
+
+    if (pipe(sigchld_pipe) != 0) {
+        error("パイプを作れません: %s", strerror(errno));
+    }
+    fcntl(sigchld_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(sigchld_pipe[1], F_SETFL, O_NONBLOCK);
+    struct sigaction sa = {.sa_handler = on_sigchld, .sa_flags = SA_RESTART | SA_NOCLDSTOP};
+    sigaction(SIGCHLD, &sa, NULL);
+
+    // 止める要求を受けたら新しい接続は受け付けず、処理中の要求が終わるのを待つ
+    bool stopping = false;
+    while (!stopping || jobs != NULL) {
+        // 待つのは子プロセスの終了、新しい接続、子プロセスからのキャッシュの更新
+        int njobs = 0;
+        for (Job *job = jobs; job != NULL; job = job->next) {
+            njobs++;
+        }
+        struct pollfd *pfds = calloc(njobs + 2, sizeof(struct pollfd));
+        int n = 0;
+        pfds[n++] = (struct pollfd){.fd = sigchld_pipe[0], .events = POLLIN};
+        pfds[n++] = (struct pollfd){.fd = stopping ? -1 : sock, .events = POLLIN};
+        for (Job *job = jobs; job != NULL; job = job->next) {
+            pfds[n++] = (struct pollfd){.fd = job->pipe, .events = POLLIN};
+        }
+        if (poll(pfds, n, -1) < 0) {
+            free(pfds);
+            if (errno == EINTR) {
+                continue;
+            }
+            error("待機に失敗しました: %s", strerror(errno));
+        }
+
+        n = 2;
+        for (Job *job = jobs; job != NULL; job = job->next) {
+            if (pfds[n++].revents != 0) {
+                read_job(job);
+            }
+        }
+        reap_children();
+        finish_jobs();
+
+        if (pfds[1].revents != 0) {
+            int conn = accept(sock, NULL, NULL);
+            if (conn >= 0 && serve(conn, sock)) {
+                stopping = true;
+                close(sock);
+                unlink(path);
+            }
+        }
+        free(pfds);
+    }
+}
+
+// サーバに引数と標準入出力を渡してコンパイルさせ、その終了ステータスを返す
+int run_client(char *path, int argc, char **argv) {
+    struct sockaddr_un addr;
+    socket_address(&addr, path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        error("%sに接続できません: %s", path, strerror(errno));
+    }
+
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        error("作業ディレクトリが分かりません: %s", strerror(errno));
+    }
+    size_t len = strlen(cwd) + 1;
+    for (int i = 0; i < argc; i++) {
+        len += strlen(argv[i]) + 1;
+    }
+    char *payload = malloc(len);
+    char *p = payload;
+    p = stpcpy(p, cwd) + 1;
+    for (int i = 0; i < argc; i++) {
+        p = stpcpy(p, argv[i]) + 1;
+    }
+
+    uint32_t len32 = len;
+    int fds[3] = {0, 1, 2};
+    char cbuf[CMSG_SPACE(sizeof(fds))] = {};
+    struct iovec iov = {&len32, sizeof(len32)};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = cbuf, .msg_controllen = sizeof(cbuf)};
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    if (sendmsg(sock, &msg, 0) != sizeof(len32)) {
+        error("要求を送れません: %s", strerror(errno));
+    }
+    write_all(sock, payload, len);
+
+    int status;
+    if (!read_all(sock, &status, sizeof(status))) {
+        error("サーバから応答がありません");
+    }
+    close(sock);
+    return status;
+}
@@ -1,6 +1,11 @@
 #!/bin/sh
 
-cat <<EOF | gcc -xc -c -o tmp2.o -
+# ./test.sh --run とするとアセンブルとリンクを経ずに9ccの中で実行する
+# ./test.sh --interp とするとバイトコードに変換して9ccの中で解釈実行する
+# ./test.sh -c とすると9ccが直接出力したオブジェクトファイルをリンクする
+mode="$1"
+
+helpers=$(cat <<EOF
 int ret3() { return 3; }
 int ret5() { return 5; }
 int add(int x, int y) { return x + y; }
@@ -10,20 +15,45 @@ int add6(int a, int b, int c, int d, int e, int f) {
     return a + b + c + d + e + f;
 }
 EOF
+)
+echo "$helpers" | gcc -xc -c -o tmp2.o -
+if [ "$mode" = "--run" ] || [ "$mode" = "--interp" ]; then
+    echo "$helpers" | gcc -xc -shared -fPIC -o tmp2.so -
+fi
 
+# try 期待値 入力 [オプション...]
 try() {
     expected="$1"
     input="$2"
+    shift 2
+
+    if [ "$mode" = "--run" ]; then
+        ./9cc --run --load=./tmp2.so "$@" "$input"
+        actual="$?"
+    elif [ "$mode" = "--interp" ]; then
+        ./9cc --interp --load=./tmp2.so "$@" "$input"
+        actual="$?"
+    elif [ "$mode" = "-c" ]; then
+        ./9cc -c "$@" "$input" > tmp.o
+        gcc -o tmp tmp.o tmp2.o
+        ./tmp
+        actual="$?"
+    else
+        ./9cc "$@" "$input" > tmp.s
+        gcc -g -o tmp tmp.s tmp2.o
+        ./tmp
+        actual="$?"
+    fi
 
-    ./9cc "$input" > tmp.s
-    gcc -g -o tmp tmp.s tmp2.o
-    ./tmp
-    actual="$?"
+    # 長い入力は先頭だけを表示する
+    if [ ${#input} -gt 200 ]; then
+        input="$(printf '%.200s' "$input")..."
+    fi
 
     if [ "$actual" = "$expected" ]; then
-        echo "$input => $actual"
+        echo "$input${*:+ ($*)} => $actual"
     else
-        echo "$input => $expected expected, but got $actual"
+        echo "$input${*:+ ($*)} => $expected expected, but got $actual"
         exit 1
     fi
 }
@@ -95,6 +125,137 @@ try 2 'main() { return sub(5, 3); }'
 try 21 'main() { return add6(1, 2, 3, 4, 5, 6); }'
 try 32 'main() { return ret32(); } ret32() { return 32; }'
 try 6 'main() { return h(); } h() { return sub(9, 3); }'
+try 55 'main() { j=0; for (i=0; i<=10; i=i+1) j=i+j; return j; }' -funroll-loops
+try 150 'main() { j=0; for (i=0; i<100; i=i+1) j=j+i; return j-4900+i; }' -funroll-loops
+try 150 'main() { j=0; for (i=0; i<100; i=i+1) j=j+i; return j-4900+i; }' -funroll-loops=3
+try 149 'main() { j=0; for (i=3; i<100; i=2+i) j=j+1; return j+i-1; }' -funroll-loops=4
+try 55 'main() { i=0; j=0; for (; i<=10; i=i+1) j=i+j; return j; }' -funroll-loops
+try 7 'main() { for (i=7; i<3; i=i+1) return 1; return i; }' -funroll-loops
+try 18 'main() { j=0; for (i=0; i<3; i=i+1) for (k=0; k<4; k=k+1) j=j+i*k; return j; }' -funroll-loops
+try 9 'main() { for (i=0; i<20; i=i+1) if (i==9) return i; return 0; }' -funroll-loops=2
+try 20 'main() { j=0; for (i=0; i<10; i=i+1) i=i+1; for (k=0; k<20; k=k+1) j=j+1; return j; }' -funroll-loops
+try 150 'main() { j=0; for (i=0; i<100; i=i+1) j=j+i; return j-4900+i; }' -funroll-loops=64
+# 数として読めない、あるいは大きすぎる倍率は受け付けない
+for factor in 4abc '' 0 65 99999999999999999999; do
+    if ./9cc -funroll-loops=$factor 'main() { return 0; }' > /dev/null 2>&1; then
+        echo "-funroll-loops=$factor accepted"
+        exit 1
+    fi
+done
+try 58 'main() { return fib10() + ret3(); } fib10() { a=0; b=1; for (i=0; i<10; i=i+1) { t=a+b; a=b; b=t; } return a; }' -ffold-pure-calls
+try 12 'main() { return f(3, 4); } f() { return g(1) * 2; } g() { x=2; while (x < 6) x=x+1; return x; }' -ffold-pure-calls
+try 4 'main() { return f(); } f() { return ret3() + 1; }' -ffold-pure-calls
+try 30 'main() { return big(); } big() { j=0; for (i=0; i<3000000; i=i+1) j=j+1; return j/100000; }' -ffold-pure-calls
+try 6 'main() { return f(1) + f(2); } f() { if (1) return 3; } g() { return 0; }' -ffold-pure-calls
+try 21 'main() { return f(); } f() { return g(0) / 2 + 1; } g() { return 40; }' -ffold-pure-calls -funroll-loops
+
+# 深く入れ子になった式や長い演算子の列
+deep=10000
+try 42 "main() { return $(printf '(%.0s' $(seq $deep))42$(printf ')%.0s' $(seq $deep)); }"
+try 16 "main() { return 0$(printf -- '+1%.0s' $(seq $deep)); }"
+try 1 "main() { return $(printf '1-(%.0s' $(seq $deep))1$(printf ')%.0s' $(seq $deep)); }"
+try 7 "main() { $(printf 'a=%.0s' $(seq $deep))7; return a; }"
+try 3 "main() { return $(printf -- '-%.0s' $(seq $deep))3; }"
+
+# 最適化やバイトコードへの変換も入れ子を再帰せずに辿る
+deeper=120000
+try 3 "main() { return $(printf -- '-%.0s' $(seq $deeper))3; }"
+try 3 "main() { return f(); } f() { return $(printf -- '-%.0s' $(seq $deeper))3; }" -ffold-pure-calls
+
+# -finstrument=branchesで得られるものと同じ形式のプロファイル
+printf '%s\n' 'func main 1:1 1 128328' 'func g 1:98 999 50098' 'branch if 1:104 999 0' \
+    'branch if 1:40 1000 1' 'branch for 1:15 1 1000' > tmp-use.prof
+try 14 'main() { s=0; for (i=0; i<1000; i=i+1) if (i==500) s=s+7; else s=s+g(add(1, 2)); return s-992; } g() { if (0) return 9; return 1; }' -fprofile-use=tmp-use.prof
+try 70 'main() { s=0; for (i=0; i<1000; i=i+1) if (i==500) s=s+7; else s=s+g(add(1, 2)); return s-992; } g() { if (1) return 9; return 1; }' -fprofile-use=tmp-use.prof
+try 45 'main() { a=1; b=2; c=3; d=4; e=5; f=6; for (i=0; i<10; i=i+1) a=a+b+c+d+e+f-20+i; return a+ret3()-4; }' -fprofile-use=tmp-use.prof
+try 20 'main() { j=0; for (i=0; i<10; i=i+1) j=j+f(); return j; }
+f() { return 2; }' -g
+
+# 計測用のコードはアセンブリの出力でしか生成できない
+if [ -z "$mode" ]; then
+    export NINECC_PROFILE=tmp.prof
+    rm -f tmp.prof
+    try 6 'main() { j=0; for (i=0; i<10; i=i+1) if (i<3) j=j+f(); return j; } f() { return 2; }' -finstrument=branches
+    try 150 'main() { j=0; for (i=0; i<100; i=i+1) j=j+i; return j-4900+i; }' -finstrument=branches -funroll-loops
+    try 21 'main() { return add6(1, 2, 3, 4, 5, 6); }' -finstrument
+    grep -q '^func f 1:68 3 ' tmp.prof || { echo "unexpected profile:"; cat tmp.prof; exit 1; }
+    grep -q '^branch if 1:38 10 3$' tmp.prof || { echo "unexpected profile:"; cat tmp.prof; exit 1; }
+    rm -f tmp.prof
+    try 6 'main() { j=0; for (i=0; i<300; i=i+1) if (i<3) j=j+f(); return j; } f() { return 2; }' -finstrument=branches
+    try 6 'main() { j=0; for (i=0; i<300; i=i+1) if (i<3) j=j+f(); return j; } f() { return 2; }' -fprofile-use=tmp.prof
+    # サイクル数は-finstrument=cyclesのときだけ計測する
+    rm -f tmp.prof
+    try 6 'main() { j=0; for (i=0; i<10; i=i+1) if (i<3) j=j+f(); return j; } f() { return 2; }' -finstrument
+    grep -q '^func f 1:68 3 0$' tmp.prof || { echo "unexpected profile:"; cat tmp.prof; exit 1; }
+    rm -f tmp.prof
+    try 6 'main() { j=0; for (i=0; i<10; i=i+1) if (i<3) j=j+f(); return j; } f() { return 2; }' -finstrument=cycles -finstrument=branches
+    grep -q '^func f 1:68 3 [1-9][0-9]*$' tmp.prof && grep -q '^branch if 1:38 10 3$' tmp.prof ||
+        { echo "unexpected profile:"; cat tmp.prof; exit 1; }
+    unset NINECC_PROFILE
+
+    try 20 'main() { j=0; for (i=0; i<10; i=i+1) j=j+f(); return j; }
+f() { return 2; }' -g
+    grep -q '^  \.loc 1 2 7$' tmp.s || { echo "line info not found:"; cat tmp.s; exit 1; }
+    try 5 'main() { a = 1;
+return f(); } f() { return 5; }' -ffold-pure-calls -g
+    grep -q '^  \.loc 1 2 8$' tmp.s || { echo "line info of folded call not found:"; cat tmp.s; exit 1; }
+
+    # フェーズごとに確保を要求したバイト数を報告する
+    ./9cc -ftime-report=json 'main() { return f(); } f() { return 2; }' 2> tmp.json > /dev/null
+    grep -q '{"name": "parse", [^}]*"alloc_bytes": [1-9][0-9]*, "process_peak_rss_kb": [1-9]' tmp.json ||
+        { echo "unexpected time report:"; cat tmp.json; exit 1; }
+
+    # 再帰を使わないので、小さなスタックでも深い入れ子を扱える
+    chain="main() { return 0$(printf -- '+1%.0s' $(seq 60000)); }"
+    for opts in --interp "--run -ffold-pure-calls" "--run -ftime-report=json -funroll-loops"; do
+        (ulimit -s 1024; ./9cc $opts "$chain" 2> /dev/null)
+        actual="$?"
+        if [ "$actual" != 96 ]; then
+            echo "60000 terms ($opts) => 96 expected, but got $actual"
+            exit 1
+        fi
+        echo "60000 terms ($opts) => $actual"
+    done
+
+    # コンパイルサーバ。変更のない関数の出力はキャッシュから再利用する
+    ./9cc --server=tmp.sock &
+    until ./9cc --client=tmp.sock --server-stats > /dev/null 2>&1; do sleep 0.1; done
+    try 7 'main() { return f() + g(); } f() { return 3; } g() { if (1) return 4; return 0; }' --client=tmp.sock
+    try 7 'main() { return f() + g(); } f() { return 3; } g() { if (1) return 4; return 0; }' --client=tmp.sock
+    ./9cc 'main() { return f() + g(); } f() { return 3; } g() { if (1) return 4; return 0; }' | cmp -s - tmp.s ||
+        { echo "cached output differs"; exit 1; }
+    try 8 'main() { return f() + g() + 1; } f() { return 3; } g() { if (1) return 4; return 0; }' --client=tmp.sock
+    try 7 'main() { return f() + g(); } f() { return 3; } g() { if (1) return 4; return 0; }' --client=tmp.sock -funroll-loops
+    ./9cc --client=tmp.sock --server-stats > tmp.stats
+    # 時間のかかる要求の処理中も、他の要求を受け付ける
+    ./9cc --client=tmp.sock --run 'main() { for (i=0; i<1000000000; i=i+1) 0; return 1; }' &
+    slow=$!
+    sleep 0.2
+    try 7 'main() { return f() + g(); } f() { return 3; } g() { if (1) return 4; return 0; }' --client=tmp.sock
+    kill -0 $slow 2> /dev/null || { echo "server did not handle requests concurrently"; exit 1; }
+    status=0
+    wait $slow || status=$?
+    [ "$status" = 1 ] || { echo "slow request => $status, 1 expected"; exit 1; }
+    ./9cc --client=tmp.sock --server-stop
+    wait
+    grep -q '^hits 5$' tmp.stats && grep -q '^misses 7$' tmp.stats ||
+        { echo "unexpected server stats:"; cat tmp.stats; exit 1; }
+fi
+
+# 実行時に生成したコードの関数名をperfに教える
+if [ "$mode" = "--run" ]; then
+    ./9cc --run 'main() { return f(); } f() { return 7; }' &
+    pid=$!
+    wait $pid
+    grep -q ' f$' /tmp/perf-$pid.map && grep -q ' main$' /tmp/perf-$pid.map ||
+        { echo "perf map not written:"; cat /tmp/perf-$pid.map; exit 1; }
+    rm -f /tmp/perf-$pid.map
+    # 書き出せなくても警告するだけで実行は続ける
+    NINECC_PERF_MAP_DIR=/nonexistent ./9cc --run 'main() { return 7; }' 2> tmp.err
+    status="$?"
+    [ "$status" = 7 ] && grep -q 'perf-.*\.map' tmp.err ||
+        { echo "unwritable perf map => $status:"; cat tmp.err; exit 1; }
+fi
 
 echo OK
 
@@ -0,0 +1,223 @@
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
+#include "9cc.h"
+
+// 反復回数がこれ以下のループは完全に展開する
+#define FULL_UNROLL_LIMIT 16
+
+// 展開後の本体のノード数がこれを越えるループは展開しない
+#define UNROLL_NODE_LIMIT 512
+
+// 単純な計数ループの情報
+typedef struct CountedLoop CountedLoop;
+struct CountedLoop {
+    LVar *var;       // 帰納変数
+    NodeKind cmp;    // ND_LTまたはND_LE
+    long limit;      // 比較の右辺の定数
+    long step;       // 1回の反復での増分(正)
+    bool has_start;  // 初期値が定数であるか
+    long start;      // 初期値
+};
+
+static void unroll_stmt(Node *node);
+
+static bool is_assign_to(Node *node, void *var) {
+    return node->kind == ND_ASSIGN && node->lhs->kind == ND_LVAR && node->lhs->var == var;
+}
+
+// nodeの中に変数varへの代入があるか調べる
+static bool assigns_to(Node *node, LVar *var) {
+    return walk_nodes(node, false, is_assign_to, var);
+}
+
+static bool is_var(Node *node, LVar *var) {
+    return node->kind == ND_LVAR && node->var == var;
+}
+
+// for (i = a; i < n; i = i + s) の形をしたループならば真を返し、loopに情報を格納する。
+// 初期化式は省略されていてもよく、iへの代入はincの中だけでなければならない。
+static bool match_counted_loop(Node *node, CountedLoop *loop) {
+    Node *cond = node->cond;
+    if (cond == NULL || (cond->kind != ND_LT && cond->kind != ND_LE)) {
+        return false;
+    }
+    if (cond->lhs->kind != ND_LVAR || cond->rhs->kind != ND_NUM) {
+        return false;
+    }
+    LVar *var = cond->lhs->var;
+
+    // 増分式は i = i + s または i = s + i
+    Node *inc = node->inc;
+    if (inc == NULL || inc->lhs->kind != ND_ASSIGN || !is_var(inc->lhs->lhs, var)) {
+        return false;
+    }
+    Node *add = inc->lhs->rhs;
+    if (add->kind != ND_ADD) {
+        return false;
+    }
+    Node *step;
+    if (is_var(add->lhs, var) && add->rhs->kind == ND_NUM) {
+        step = add->rhs;
+    } else if (is_var(add->rhs, var) && add->lhs->kind == ND_NUM) {
+        step = add->lhs;
+    } else {
+        return false;
+    }
+    if (step->val <= 0) {
+        return false;
+    }
+
+    if (assigns_to(node->body, var)) {
+        return false;
+    }
+
+    loop->var = var;
+    loop->cmp = cond->kind;
+    loop->limit = cond->rhs->val;
+    loop->step = step->val;
+    loop->has_start = false;
+
+    // 初期化式が i = 定数 ならば反復回数が求まる
+    Node *init = node->init;
+    if (init != NULL && init->lhs->kind == ND_ASSIGN &&
+        is_var(init->lhs->lhs, var) && init->lhs->rhs->kind == ND_NUM) {
+        loop->has_start = true;
+        loop->start = init->lhs->rhs->val;
+    }
+    return true;
+}
+
+// 反復回数を求める
+static long trip_count(CountedLoop *loop) {
+    if (loop->cmp == ND_LT) {
+        if (loop->start >= loop->limit) {
+            return 0;
+        }
+        return (loop->limit - loop->start + loop->step - 1) / loop->step;
+    }
+    if (loop->start > loop->limit) {
+        return 0;
+    }
+    return (loop->limit - loop->start) / loop->step + 1;
+}
+
+// bodyとincの複製をn回分curの後ろに繋げ、新たな最後尾を返す
+static Node *append_iterations(Node *cur, Node *body, Node *inc, long n) {
+    for (long i = 0; i < n; i++) {
+        cur->next = copy_node(body, NULL);
+        cur = cur->next;
+        cur->next = copy_node(inc, NULL);
+        cur = cur->next;
+    }
+    return cur;
+}
+
+// nodeを、文の列stmtsを持つブロックに置き換える。文の連結(next)は保つ
+static void replace_with_block(Node *node, Node *stmts) {
+    Node *next = node->next;
+    Token *tok = node->tok;
+    memset(node, 0, sizeof(Node));
+    node->kind = ND_BLOCK;
+    node->block = stmts;
+    node->next = next;
+    node->tok = tok;
+}
+
+// 計数ループを展開する。展開できなければ何もしない
+static void unroll_for(Node *node) {
+    CountedLoop loop;
+    if (!match_counted_loop(node, &loop)) {
+        return;
+    }
+
+    int size = count_nodes(node->body) + count_nodes(node->inc);
+    Node head = {};
+    Node *cur = &head;
+
+    // 反復回数が少なければ、比較も分岐も残さずに完全に展開する
+    if (loop.has_start) {
+        long trip = trip_count(&loop);
+        if (trip <= FULL_UNROLL_LIMIT && size * trip <= UNROLL_NODE_LIMIT) {
+            cur->next = node->init;
+            cur = cur->next;
+            append_iterations(cur, node->body, node->inc, trip);
+            replace_with_block(node, head.next);
+            return;
+        }
+    }
+
+    int factor = opt_unroll_factor;
+    if (factor < 2 || factor > UNROLL_NODE_LIMIT / size) {
+        return;
+    }
+
+    // 本体をfactor回分まとめて実行しても条件を越えない範囲を主ループとする
+    long bound = loop.limit - (factor - 1) * loop.step;
+    if (bound < INT_MIN) {
+        return;
+    }
+
+    // 主ループ: for (; i < bound; ) { body; inc; ... }
+    Node *unrolled = new_node(ND_BLOCK);
+    Node body_head = {};
+    append_iterations(&body_head, node->body, node->inc, factor);
+    unrolled->block = body_head.next;
+
+    Node *main_loop = new_node(ND_FOR);
+    main_loop->tok = node->tok;
+    main_loop->cond = new_node_binary(loop.cmp, copy_node(node->cond->lhs, NULL), new_node_num(bound));
+    main_loop->body = unrolled;
+
+    if (node->init != NULL) {
+        cur->next = node->init;
+        cur = cur->next;
+    }
+    cur->next = main_loop;
+    cur = cur->next;
+
+    // 剰余ループ: 反復回数が分かっていれば展開し、そうでなければ元のループの形で残す
+    if (loop.has_start) {
+        append_iterations(cur, node->body, node->inc, trip_count(&loop) % factor);
+    } else {
+        Node *rest = new_node(ND_FOR);
+        rest->tok = node->tok;
+        rest->cond = node->cond;
+        rest->inc = node->inc;
+        rest->body = node->body;
+        cur->next = rest;
+    }
+
+    replace_with_block(node, head.next);
+}
+
+// 文を再帰的に辿り、内側のループから順に展開する
+static void unroll_stmt(Node *node) {
+    switch (node->kind) {
+        case ND_IF:
+            unroll_stmt(node->then);
+            if (node->els != NULL) {
+                unroll_stmt(node->els);
+            }
+            return;
+        case ND_WHILE:
+            unroll_stmt(node->body);
+            return;
+        case ND_FOR:
+            unroll_stmt(node->body);
+            unroll_for(node);
+            return;
+        case ND_BLOCK:
+            for (Node *n = node->block; n != NULL; n = n->next) {
+                unroll_stmt(n);
+            }
+            return;
+    }
+}
+
+// ループ展開のエントリポイント
+void unroll_loops(Function *prog) {
+    for (Function *fn = prog; fn != NULL; fn = fn->next) {
+        for (Node *n = fn->nodes; n != NULL; n = n->next) {
+            unroll_stmt(n);
+        }
+    }
+}